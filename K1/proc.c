@@ -20,6 +20,7 @@
 #include "mm/mman.h"
 
 #include "vm/vmmap.h"
+#include "vm/pagefault.h"
 
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
@@ -113,6 +114,9 @@ proc_info(const void *arg, char *buf, size_t osize)
 #ifdef __VM__
         iprintf(&buf, &size, "start brk:    0x%p\n", p->p_start_brk);
         iprintf(&buf, &size, "brk:          0x%p\n", p->p_brk);
+        iprintf(&buf, &size, "page faults:  %u minor, %u major, %u cow, %u fatal\n",
+                p->p_faults[PAGEFAULT_MINOR], p->p_faults[PAGEFAULT_MAJOR],
+                p->p_faults[PAGEFAULT_COW], p->p_faults[PAGEFAULT_FATAL]);
 #endif
 
         return size;
@@ -233,6 +237,10 @@ proc_create(char *name)
 
         p->p_pagedir = pt_create_pagedir();
 
+#ifdef __VM__
+        memset(p->p_faults, 0, sizeof(p->p_faults));
+#endif
+
         list_link_init(&(p->p_list_link));
         list_link_init(&(p->p_child_link));
 
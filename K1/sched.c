@@ -6,6 +6,8 @@
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
+#include "mm/pframe.h"
+
 #include "util/init.h"
 #include "util/debug.h"
 
@@ -200,6 +202,13 @@ sched_switch(void)
             queueEmpty = sched_queue_empty(&kt_runq);
             intr_setipl(IPL_LOW);
             if(queueEmpty){
+#ifdef __VM__
+                /* nothing to run: zero a page for the pool instead of
+                 * halting, then look at the run queue again */
+                if(pframe_zero_pool_refill()){
+                    continue;
+                }
+#endif
                 intr_wait();
                 dbg(DBG_PRINT, "(GRADING1A 5)\n");
             } 
@@ -18,6 +18,9 @@
 #include "vm/shadowd.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/zswap.h"
+#include "vm/readahead.h"
+#include "vm/pagefault.h"
 
 #include "main/acpi.h"
 #include "main/apic.h"
@@ -272,6 +275,11 @@ idleproc_run(int arg1, void *arg2)
         shadowd_shutdown();
 #endif
 
+#ifdef __VM__
+        /* stop the page fillers, pages being filled hold vnode references */
+        pframe_fillers_shutdown();
+#endif
+
 #ifdef __VFS__
         /* Shutdown the vfs: */
         dbg_print("weenix: vfs shutdown...\n");
@@ -398,6 +406,74 @@ static void* do_vfs_test(kshell_t *kshell, int argc, char **argv)
 
 }
 
+#ifdef __VM__
+/* Print the state of the VM subsystem. */
+static int do_vmstat(kshell_t *kshell, int argc, char **argv)
+{
+    uint32_t ratio = 0;
+
+    if (zswap_stored_bytes != 0) {
+        /* in tenths */
+        ratio = (zswap_stored_pages * (PAGE_SIZE * 10)) / zswap_stored_bytes;
+    }
+
+    kprintf(kshell, "free pages:          %d\n", page_free_count());
+    kprintf(kshell, "zero page saves:     %d\n", anon_zero_maps);
+    kprintf(kshell, "zeroed pool:         %d hits, %d misses\n",
+            pframe_zero_pool_hits, pframe_zero_pool_misses);
+    kprintf(kshell, "read-ahead pages:    %d\n", readahead_pages);
+    kprintf(kshell, "cow pages stolen:    %d\n", shadow_steals);
+#ifdef __SHADOWD__
+    kprintf(kshell, "shadows folded:      %d\n", shadowd_collapsed);
+#endif
+    kprintf(kshell, "zswap pages:         %d (%d bytes, %d in pool)\n",
+            zswap_stored_pages, zswap_stored_bytes, zswap_pool_bytes);
+    kprintf(kshell, "zswap ratio:         %d.%d:1\n", ratio / 10, ratio % 10);
+    kprintf(kshell, "zswap rejects:       %d\n", zswap_rejects);
+    kprintf(kshell, "zswap loads:         %d (avg %d cycles, max %d)\n",
+            zswap_loads, zswap_load_cycles_avg, zswap_load_cycles_max);
+    return 0;
+}
+
+/* Print page fault counts and latency histograms, system-wide and per
+ * process. */
+static int do_faultstat(kshell_t *kshell, int argc, char **argv)
+{
+    static const char *access[PAGEFAULT_NACCESS] = { "read", "write", "exec" };
+    static const char *objs[PAGEFAULT_NOBJS] = { "anon", "shadow", "vnode", "none" };
+    static const char *kinds[PAGEFAULT_NKINDS] = { "minor", "major", "cow", "fatal" };
+    int a, o, k, b;
+    proc_t *p;
+
+    kprintf(kshell, "%-14s %8s %8s %8s %8s\n", "", kinds[0], kinds[1], kinds[2], kinds[3]);
+    for (a = 0; a < PAGEFAULT_NACCESS; a++) {
+        for (o = 0; o < PAGEFAULT_NOBJS; o++) {
+            uint32_t *c = pagefault_counts[a][o];
+            if (c[0] + c[1] + c[2] + c[3] == 0) {
+                continue;
+            }
+            kprintf(kshell, "%-5s %-8s %8u %8u %8u %8u\n", access[a], objs[o], c[0], c[1], c[2], c[3]);
+        }
+    }
+
+    for (k = 0; k < PAGEFAULT_NKINDS; k++) {
+        kprintf(kshell, "%s cycles:\n", kinds[k]);
+        for (b = 0; b < PAGEFAULT_HIST_BUCKETS; b++) {
+            if (pagefault_cycles[k][b] != 0) {
+                kprintf(kshell, "    >= 2^%-2d %8u\n", b, pagefault_cycles[k][b]);
+            }
+        }
+    }
+
+    kprintf(kshell, "%5s %-13s %8s %8s %8s %8s\n", "PID", "NAME", kinds[0], kinds[1], kinds[2], kinds[3]);
+    list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+        kprintf(kshell, " %3d  %-13s %8u %8u %8u %8u\n", p->p_pid, p->p_comm,
+                p->p_faults[0], p->p_faults[1], p->p_faults[2], p->p_faults[3]);
+    } list_iterate_end();
+    return 0;
+}
+#endif
+
 #endif /* __DRIVERS__ */
 
 
@@ -431,6 +507,11 @@ initproc_run(int arg1, void *arg2)
         kshell_add_command("faber", (kshell_cmd_func_t)&do_faber, "faber test");
         dbg(DBG_PRINT, "(GRADING1B)");
 
+#ifdef __VM__
+        kshell_add_command("vmstat", (kshell_cmd_func_t)&do_vmstat, "Print VM statistics.");
+        kshell_add_command("faultstat", (kshell_cmd_func_t)&do_faultstat, "Print page fault statistics.");
+#endif
+
 #ifdef __VFS__
 
         kshell_add_command("vfstest", (kshell_cmd_func_t)&do_vfs_test, "vfs test");
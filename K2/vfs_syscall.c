@@ -9,6 +9,8 @@
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "vm/readahead.h"
 #include "util/string.h"
 #include "util/printf.h"
 #include "fs/stat.h"
@@ -57,6 +59,14 @@ do_read(int fd, void *buf, size_t nbytes)
                                 dbg(DBG_PRINT, "(GRADING2B)\n");
                                 if(bytesRead>0){
                                         dbg(DBG_PRINT, "(GRADING2B)\n");
+#ifdef __VM__
+                                        if(S_ISREG(file->f_vnode->vn_mode) && file->f_vnode->vn_ops->fillpage != NULL
+                                           && (int)bytesRead > 0){
+                                                readahead_hint(&file->f_vnode->vn_mmobj, ADDR_TO_PN(file->f_pos),
+                                                               ADDR_TO_PN(file->f_pos + bytesRead - 1),
+                                                               ADDR_TO_PN(PAGE_ALIGN_UP(file->f_vnode->vn_len)));
+                                        }
+#endif
                                         seekResult = do_lseek(fd,bytesRead,SEEK_CUR);
                                 }
                                 else if (bytesRead==0){
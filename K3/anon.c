@@ -10,8 +10,16 @@
 #include "mm/page.h"
 #include "mm/slab.h"
 #include "mm/tlb.h"
+#include "mm/pagetable.h"
+
+#include "vm/swap.h"
 
 int anon_count = 0; /* for debugging/verification purposes */
+int anon_zero_maps = 0; /* frames saved by the shared zero page */
+
+/* A single page of zeros, mapped read-only wherever an anonymous page that
+ * has never been written is read. */
+static void *anon_zero_page;
 
 static slab_allocator_t *anon_allocator;
 
@@ -21,6 +29,7 @@ static int  anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t
 static int  anon_fillpage(mmobj_t *o, pframe_t *pf);
 static int  anon_dirtypage(mmobj_t *o, pframe_t *pf);
 static int  anon_cleanpage(mmobj_t *o, pframe_t *pf);
+static int  anon_cleanpages(mmobj_t *o, pframe_t **pfs, int npages);
 
 static mmobj_ops_t anon_mmobj_ops = {
         .ref = anon_ref,
@@ -28,7 +37,8 @@ static mmobj_ops_t anon_mmobj_ops = {
         .lookuppage = anon_lookuppage,
         .fillpage  = anon_fillpage,
         .dirtypage = anon_dirtypage,
-        .cleanpage = anon_cleanpage
+        .cleanpage = anon_cleanpage,
+        .cleanpages = anon_cleanpages
 };
 
 /*
@@ -46,6 +56,9 @@ anon_init()
         KASSERT(anon_allocator);
         dbg(DBG_PRINT, "(GRADING3A 4)\n");
 
+        anon_zero_page = pframe_alloc_zeroed_page();
+        KASSERT(anon_zero_page);
+
 }
 
 /*
@@ -63,11 +76,45 @@ anon_create()
         mmobj_t *anon_obj = (mmobj_t*)slab_obj_alloc(anon_allocator);
         mmobj_init(anon_obj,&anon_mmobj_ops);  // given anon operations
         anon_obj->mmo_refcount=1;
+        anon_obj->mmo_lopage = anon_obj->mmo_hipage = 0;
         dbg(DBG_PRINT, "(GRADING3A)\n");
         return anon_obj;
 
 }
 
+/*
+ * Whether o is an anonymous object, as opposed to a shadow object or a
+ * vnode's object.
+ */
+int
+anon_is_anon(mmobj_t *o)
+{
+        return &anon_mmobj_ops == o->mmo_ops;
+}
+
+/*
+ * Returns true if the given page of an anonymous object has never been
+ * written, i.e. it is neither resident nor swapped out and so still reads
+ * as all zeros. Always false for objects which are not anonymous.
+ */
+int
+anon_untouched(mmobj_t *o, uint32_t pagenum)
+{
+        return anon_is_anon(o)
+               && (NULL == pframe_peek(o, pagenum))
+               && !swap_has(o, pagenum);
+}
+
+/*
+ * Physical address of the shared zero page. It must only ever be mapped
+ * read-only.
+ */
+uintptr_t
+anon_zero_page_paddr(void)
+{
+        return pt_virt_to_phys((uintptr_t) anon_zero_page);
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -107,18 +154,14 @@ anon_put(mmobj_t *o)
                 pframe_t *pframe_iter;
                 dbg(DBG_PRINT, "(GRADING3A 4)\n");
 
+                /* the object is dead, so there is no point in writing
+                 * its dirty pages out to swap first */
                 list_iterate_begin(&o->mmo_respages,pframe_iter,pframe_t,pf_olink) {
-                        if(!pframe_is_dirty(pframe_iter)){
-                                pframe_free(pframe_iter);
-                                dbg(DBG_PRINT, "(GRADING3A 4)\n");
-                        }else{
-                                pframe_clean(pframe_iter);
-                                pframe_free(pframe_iter);
-                                dbg(DBG_PRINT, "(GRADING3A 4)\n");
-                        }
+                        pframe_free(pframe_iter);
                         dbg(DBG_PRINT, "(GRADING3A 4)\n");
                 }
                 list_iterate_end();
+                swap_release(o);
 
                 slab_obj_free(anon_allocator,o);
                 o->mmo_refcount--;
@@ -154,10 +197,15 @@ anon_fillpage(mmobj_t *o, pframe_t *pf)
         dbg(DBG_PRINT, "(GRADING3A 4.d)\n");
 
 
-        pframe_pin(pf);
-        memset(pf->pf_addr,0,PAGE_SIZE);
-        pframe_unpin(pf);
-        dbg(DBG_PRINT, "(GRADING3A 4)\n");
+        int retVal = swap_in(o, pf);
+        if(retVal < 0){
+                dbg(DBG_PRINT, "(GRADING3A 4)\n");
+                return retVal;
+        }
+        if(retVal == 0){
+                pframe_zero(pf);
+                dbg(DBG_PRINT, "(GRADING3A 4)\n");
+        }
         return 0;
 
 }
@@ -168,6 +216,8 @@ anon_dirtypage(mmobj_t *o, pframe_t *pf)
         //NOT_YET_IMPLEMENTED("VM: anon_dirtypage");
         //return -1;
 
+        /* the copy in swap (if any) is stale from now on */
+        swap_forget(o, pf->pf_pagenum);
         pframe_set_dirty(pf);
         dbg(DBG_PRINT, "(GRADING3A)\n");
         return 1;
@@ -180,8 +230,14 @@ anon_cleanpage(mmobj_t *o, pframe_t *pf)
         //NOT_YET_IMPLEMENTED("VM: anon_cleanpage");
         //return -1;
 
-        pframe_clear_dirty(pf);
         dbg(DBG_PRINT, "(GRADING3A)\n");
-        return 1;
+        return swap_out(o, &pf, 1);
 
+}
+
+/* Write a run of consecutive dirty pages out to swap at once. */
+static int
+anon_cleanpages(mmobj_t *o, pframe_t **pfs, int npages)
+{
+        return swap_out(o, pfs, npages);
 }
\ No newline at end of file
@@ -94,6 +94,8 @@ do_brk(void *addr, void **ret)
 
 			if(check == 1){
 				area->vma_end=end;
+				vmmap_resized(temp_map, area);
+				vmmap_coalesce(temp_map, area);
 				curproc->p_brk = addr;
 				*ret = addr;
 				dbg(DBG_PRINT, "(GRADING3A)\n");
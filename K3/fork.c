@@ -74,8 +74,11 @@ do_fork(struct regs *regs)
 
         clone_proc->p_vmmap = clone_map;
 
+        /* vmmap_clone() keeps the areas in order, so the parent's area for
+         * each clone is simply the next one on the parent's list */
+        vma = list_head(&(curproc->p_vmmap->vmm_list), vmarea_t, vma_plink);
         list_iterate_begin(&(clone_map->vmm_list), clone_vma, vmarea_t, vma_plink){
-            vma = vmmap_lookup(curproc->p_vmmap, clone_vma->vma_start);
+            KASSERT(vma->vma_start == clone_vma->vma_start);
             if(clone_vma->vma_flags & MAP_PRIVATE){
                 vma->vma_obj->mmo_ops->ref(vma->vma_obj);
 
@@ -89,6 +92,13 @@ do_fork(struct regs *regs)
 
                 vma->vma_obj = to_delete;
                 clone_vma->vma_obj = new_shadowed;
+
+                /* the parent keeps its mappings, but has to fault on the
+                 * next write to get its own copy */
+                if(vma->vma_prot & PROT_WRITE){
+                    pframe_rmap_protect(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(vma->vma_start),
+                                        (uintptr_t) PN_TO_ADDR(vma->vma_end));
+                }
                 dbg(DBG_PRINT, "(GRADING3A 7)\n");
             }else{
                 clone_vma->vma_obj = vma->vma_obj;
@@ -99,6 +109,7 @@ do_fork(struct regs *regs)
             dbg(DBG_PRINT, "(GRADING3A 7)\n");
 
             list_insert_tail(mmobj_bottom_vmas(vma->vma_obj), &(clone_vma->vma_olink));
+            vma = list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
         }list_iterate_end();
 
         kthread_t *clone_thread = kthread_clone(curthr);
@@ -127,7 +138,6 @@ do_fork(struct regs *regs)
             dbg(DBG_PRINT, "(GRADING3A 7)\n");
         }
 
-        pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
         tlb_flush_all();
 
         clone_proc->p_start_brk = curproc->p_start_brk;
@@ -6,6 +6,7 @@
 #include "mm/tlb.h"
 #include "mm/mman.h"
 #include "mm/page.h"
+#include "mm/pframe.h"
 
 #include "proc/proc.h"
 
@@ -81,6 +82,17 @@ do_mmap(void *addr, size_t len, int prot, int flags,
 		}
 
 
+		/* pick the address here rather than in vmmap_map(), which may
+		 * merge the mapping into a neighbouring area */
+		if(addr_var == 0){
+			int found = vmmap_find_range(curproc->p_vmmap, ((len-1)/PAGE_SIZE + 1), VMMAP_DIR_HILO);
+			if(found < 0){
+				dbg(DBG_PRINT, "(GRADING3A 2)\n");
+				return -ENOMEM;
+			}
+			addr_var = found;
+		}
+
 		if(flags & MAP_ANON){
 			result = vmmap_map(curproc->p_vmmap, 0, addr_var, ((len-1)/PAGE_SIZE + 1), prot, flags, off, VMMAP_DIR_HILO, &area);
 			dbg(DBG_PRINT, "(GRADING3A 2)\n");
@@ -109,6 +121,12 @@ do_mmap(void *addr, size_t len, int prot, int flags,
 				dbg(DBG_PRINT, "(GRADING3A 2)\n");
 			}
 			result = vmmap_map(curproc->p_vmmap, ourFile->f_vnode, addr_var, ((len-1)/PAGE_SIZE + 1), prot, flags, off, VMMAP_DIR_HILO, &area);
+			/* mprotect() must not grant a shared mapping write access
+			 * that the file was not opened with */
+			if((result >= 0) && (flags & MAP_SHARED) && !(ourFile->f_mode & FMODE_WRITE)){
+				area->vma_maxprot &= ~PROT_WRITE;
+				dbg(DBG_PRINT, "(GRADING3A 2)\n");
+			}
 			fput(ourFile);
 			dbg(DBG_PRINT, "(GRADING3A 2)\n");
 		}
@@ -118,12 +136,13 @@ do_mmap(void *addr, size_t len, int prot, int flags,
 			return result;
 		}
 
-		*ret = PN_TO_ADDR(area->vma_start);
-		pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(area->vma_start), (uintptr_t)PN_TO_ADDR(area->vma_start) + (uintptr_t)PAGE_ALIGN_UP(len));
+		*ret = PN_TO_ADDR(addr_var);
+		pframe_rmap_remove(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(addr_var), (uintptr_t)PN_TO_ADDR(addr_var) + (uintptr_t)PAGE_ALIGN_UP(len));
+		pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(addr_var), (uintptr_t)PN_TO_ADDR(addr_var) + (uintptr_t)PAGE_ALIGN_UP(len));
 
 		KASSERT(NULL != curproc->p_pagedir);
 
-		tlb_flush_range((uintptr_t)PN_TO_ADDR(area->vma_start), (uint32_t)PAGE_ALIGN_UP(len)/PAGE_SIZE);
+		tlb_flush_range((uintptr_t)PN_TO_ADDR(addr_var), (uint32_t)PAGE_ALIGN_UP(len)/PAGE_SIZE);
 
 		dbg(DBG_PRINT, "(GRADING3A 2.a)\n");
 
@@ -159,4 +178,138 @@ do_munmap(void *addr, size_t len)
 		tlb_flush_all();
 		dbg(DBG_PRINT, "(GRADING3A)\n");
 		return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * This function implements the mprotect(2) syscall.
+ *
+ * Changes the protection of every page in [addr, addr + len), all of which
+ * must be mapped, by calling upon vmmap_protect(). Resident pages are not
+ * unmapped: present mappings that lose write access are write-protected
+ * in place, so only the range itself needs to be flushed from the TLB.
+ */
+int
+do_mprotect(void *addr, size_t len, int prot)
+{
+		unsigned int addr_var = ADDR_TO_PN(addr);
+		unsigned int npages;
+
+		if(!PAGE_ALIGNED(addr) || (len<=0) || (len>(USER_MEM_HIGH-USER_MEM_LOW)) || ((unsigned int)addr + len) > USER_MEM_HIGH || ((unsigned int)addr < USER_MEM_LOW)){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -EINVAL;
+		}
+
+		if(prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -EINVAL;
+		}
+
+		npages = (len-1)/PAGE_SIZE + 1;
+		int result = vmmap_protect(curproc->p_vmmap, addr_var, npages, prot);
+		if(result < 0){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return result;
+		}
+		tlb_flush_range((uintptr_t)addr, npages);
+		dbg(DBG_PRINT, "(GRADING3A)\n");
+		return 0;
+}
+
+/*
+ * This function implements the madvise(2) syscall, supporting
+ * MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED,
+ * MADV_DONTNEED and MADV_FREE.
+ *
+ * After error checking the advice is handed to vmmap_advise(), which
+ * either records it on the vmareas of the range or acts on it at once.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+		unsigned int addr_var = ADDR_TO_PN(addr);
+		unsigned int npages;
+
+		if(!PAGE_ALIGNED(addr) || (len<=0) || (len>(USER_MEM_HIGH-USER_MEM_LOW)) || ((unsigned int)addr + len) > USER_MEM_HIGH || ((unsigned int)addr < USER_MEM_LOW)){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -EINVAL;
+		}
+
+		npages = (len-1)/PAGE_SIZE + 1;
+		int result = vmmap_advise(curproc->p_vmmap, addr_var, npages, advice);
+		if(result < 0){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return result;
+		}
+		tlb_flush_range((uintptr_t)addr, npages);
+		dbg(DBG_PRINT, "(GRADING3A)\n");
+		return 0;
+}
+
+/*
+ * This function implements the mremap(2) syscall, supporting only the
+ * MREMAP_MAYMOVE flag.
+ *
+ * Resizes the mapping at addr from old_len to new_len bytes with
+ * vmmap_remap(), which grows it in place when it can and otherwise, if
+ * MREMAP_MAYMOVE is given, moves the vmarea and its page table entries
+ * instead of copying any page. The new address is stored in *ret.
+ */
+int
+do_mremap(void *addr, size_t old_len, size_t new_len, int flags, void **ret)
+{
+		unsigned int addr_var = ADDR_TO_PN(addr);
+		unsigned int oldpages, newpages;
+
+		if(!PAGE_ALIGNED(addr) || (old_len<=0) || (new_len<=0) || (flags & ~MREMAP_MAYMOVE)){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -EINVAL;
+		}
+
+		if((old_len>(USER_MEM_HIGH-USER_MEM_LOW)) || (new_len>(USER_MEM_HIGH-USER_MEM_LOW)) || ((unsigned int)addr + old_len) > USER_MEM_HIGH || ((unsigned int)addr < USER_MEM_LOW)){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -EINVAL;
+		}
+
+		oldpages = (old_len-1)/PAGE_SIZE + 1;
+		newpages = (new_len-1)/PAGE_SIZE + 1;
+		int result = vmmap_remap(curproc->p_vmmap, addr_var, oldpages, newpages, flags & MREMAP_MAYMOVE);
+		/* whatever happened, nothing stale may stay behind for the old range */
+		tlb_flush_range((uintptr_t)addr, oldpages);
+		if(result < 0){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return result;
+		}
+
+		*ret = PN_TO_ADDR(result);
+		dbg(DBG_PRINT, "(GRADING3A)\n");
+		return 0;
+}
+
+/*
+ * This function implements the msync(2) syscall.
+ *
+ * Writes back the dirty pages of the shared file mappings in
+ * [addr, addr + len) with vmmap_sync(), leaving every other dirty page in
+ * the system alone (unlike sync(2)). MS_SYNC also waits for pages that
+ * are already being written; MS_ASYNC skips them. MS_INVALIDATE needs no
+ * work, since mappings and file reads share the same page cache.
+ */
+int
+do_msync(void *addr, size_t len, int flags)
+{
+		unsigned int addr_var = ADDR_TO_PN(addr);
+
+		if(!PAGE_ALIGNED(addr) || (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) || ((flags & MS_ASYNC) && (flags & MS_SYNC))){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -EINVAL;
+		}
+
+		if((len<=0) || (len>(USER_MEM_HIGH-USER_MEM_LOW)) || ((unsigned int)addr + len) > USER_MEM_HIGH || ((unsigned int)addr < USER_MEM_LOW)){
+			dbg(DBG_PRINT, "(GRADING3A)\n");
+			return -ENOMEM;
+		}
+
+		int result = vmmap_sync(curproc->p_vmmap, addr_var, (len-1)/PAGE_SIZE + 1, flags & MS_SYNC);
+		dbg(DBG_PRINT, "(GRADING3A)\n");
+		return result;
+}
@@ -16,9 +16,113 @@
 
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/readahead.h"
+#include "vm/swap.h"
 
 #include "mm/tlb.h"
 
+/*
+ * Page fault statistics. Every fault is counted by the kind of access, the
+ * kind of object its page came from and how it was resolved:
+ *     - minor: the page was already resident (or the zero page was mapped)
+ *     - major: the page had to be filled from disk or swap
+ *     - cow:   a write to a private mapping copied the page into the
+ *              mapping's own shadow object
+ *     - fatal: the fault killed the process
+ * The time spent in each fault, in cycles, goes into a log2 histogram per
+ * kind of resolution (bucket i counts faults that took [2^i, 2^(i+1))
+ * cycles). The counts by kind are also kept per process, in p_faults.
+ */
+uint32_t pagefault_counts[PAGEFAULT_NACCESS][PAGEFAULT_NOBJS][PAGEFAULT_NKINDS];
+uint32_t pagefault_cycles[PAGEFAULT_NKINDS][PAGEFAULT_HIST_BUCKETS];
+
+static inline uint64_t
+pagefault_rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return (((uint64_t) hi) << 32) | lo;
+}
+
+/*
+ * Account for a fault that started at cycle start.
+ *
+ * @param o the object the page came from, or NULL if there is none
+ * @param kind one of PAGEFAULT_MINOR, _MAJOR, _COW or _FATAL
+ */
+static void
+pagefault_account(uint64_t start, uint32_t cause, mmobj_t *o, int kind)
+{
+        uint32_t cycles = (uint32_t) (pagefault_rdtsc() - start);
+        int access, obj, bucket;
+
+        if (cause & FAULT_WRITE)
+                access = PAGEFAULT_WRITE;
+        else if (cause & FAULT_EXEC)
+                access = PAGEFAULT_EXEC;
+        else
+                access = PAGEFAULT_READ;
+
+        if (NULL == o)
+                obj = PAGEFAULT_NOOBJ;
+        else if (anon_is_anon(o))
+                obj = PAGEFAULT_ANON;
+        else if (shadow_is_shadow(o))
+                obj = PAGEFAULT_SHADOW;
+        else
+                obj = PAGEFAULT_VNODE;
+
+        for (bucket = 0; (cycles >>= 1) && (bucket < PAGEFAULT_HIST_BUCKETS - 1); ++bucket)
+                ;
+
+        pagefault_counts[access][obj][kind]++;
+        pagefault_cycles[kind][bucket]++;
+        curproc->p_faults[kind]++;
+}
+
+/* Number of pages, aligned in the address space, around a read fault that
+ * are mapped along with the faulting page if they are already resident. */
+#define FAULT_AROUND_PAGES 16
+
+/*
+ * Map the resident, non-busy pages of vmarea that lie in the
+ * FAULT_AROUND_PAGES window around the page pn that has just been faulted
+ * in, so that a scan over them does not take one fault per page. The pages
+ * are mapped read-only no matter what the area allows: for private areas
+ * the page found may belong to an object further down the shadow chain,
+ * and for shared areas a write has to fault anyway so that the page is
+ * dirtied. Addresses that already have a mapping are left alone. Each page
+ * mapped counts as a reference, so that the aging pass does not mistake a
+ * page it just unmapped for an idle one once we have mapped it again.
+ */
+static void
+fault_around(vmarea_t *vmarea, uint32_t pn)
+{
+        uint32_t vfn, lo, hi;
+
+        lo = MAX(pn & ~(FAULT_AROUND_PAGES - 1), vmarea->vma_start);
+        hi = MIN(lo + FAULT_AROUND_PAGES, vmarea->vma_end);
+
+        for (vfn = lo; vfn < hi; ++vfn) {
+                uintptr_t va = (uintptr_t) PN_TO_ADDR(vfn);
+                pframe_t *pf;
+
+                if ((vfn == pn) || (NULL != pframe_rmap_lookup(curproc->p_pagedir, va)))
+                        continue;
+                if (NULL == (pf = shadow_resident(vmarea->vma_obj,
+                                                  vfn - vmarea->vma_start + vmarea->vma_off)))
+                        continue;
+                if (0 > pframe_rmap_add(pf, curproc->p_pagedir, va))
+                        return;
+                pframe_reference(pf);
+                pt_map(curproc->p_pagedir, va, pt_virt_to_phys((uintptr_t) pf->pf_addr),
+                       PD_PRESENT | PD_USER, PT_PRESENT | PT_USER);
+                tlb_flush(va);
+        }
+}
+
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
  * calling function has already done a lot of error checking for
@@ -55,19 +159,23 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
 {
         //NOT_YET_IMPLEMENTED("VM: handle_pagefault");
 
+        uint64_t start = pagefault_rdtsc();
 	uint32_t pn = ADDR_TO_PN(vaddr);
     vmarea_t *vmarea = vmmap_lookup(curproc->p_vmmap, pn);
     dbg(DBG_PRINT, "(GRADING3A 5)\n");
     if(vmarea != NULL && !(vmarea->vma_prot & PROT_WRITE) && (cause & FAULT_WRITE)){
         dbg(DBG_PRINT, "(GRADING3A 5)\n");
+        pagefault_account(start, cause, vmarea->vma_obj, PAGEFAULT_FATAL);
         do_exit(EFAULT);
     }
     else if(vmarea != NULL && !(vmarea->vma_prot & PROT_READ) && !(cause & FAULT_EXEC) && !(cause & FAULT_WRITE)){
         dbg(DBG_PRINT, "(GRADING3A 5)\n");
+        pagefault_account(start, cause, vmarea->vma_obj, PAGEFAULT_FATAL);
         do_exit(EFAULT);
     }
     else if(vmarea == NULL){
         dbg(DBG_PRINT, "(GRADING3A 5)\n");
+        pagefault_account(start, cause, NULL, PAGEFAULT_FATAL);
         do_exit(EFAULT);
     }
     else{
@@ -75,15 +183,38 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
         uint32_t pd = PD_PRESENT | PD_USER;
         uint32_t pt = PT_PRESENT | PT_USER;
         pframe_t *pf;
+        uint32_t pagenum = pn - vmarea->vma_start + vmarea->vma_off;
+        uintptr_t va = (uintptr_t) PAGE_ALIGN_DOWN(vaddr);
         if(cause & FAULT_WRITE){
             pd = pd | PD_WRITE;
             pt = pt | PT_WRITE;
             fw=1;
             dbg(DBG_PRINT, "(GRADING3A 5)\n");
         }
-        int lookUpResult = pframe_lookup(vmarea->vma_obj, pn - vmarea->vma_start + vmarea->vma_off, fw, &pf);
+        if(!fw && (vmarea->vma_flags & MAP_PRIVATE) && shadow_untouched(vmarea->vma_obj, pagenum)){
+            /* reading a private anonymous page nobody has written yet: map
+             * the shared zero page read-only, the first write faults again
+             * and gets a page of its own */
+            pframe_rmap_remove(curproc->p_pagedir, va, va + PAGE_SIZE);
+            pt_map(curproc->p_pagedir, va, anon_zero_page_paddr(), pd, pt);
+            tlb_flush(va);
+            anon_zero_maps++;
+            pagefault_account(start, cause, mmobj_bottom_obj(vmarea->vma_obj), PAGEFAULT_MINOR);
+            dbg(DBG_PRINT, "(GRADING3A 5)\n");
+            return;
+        }
+        int kind = PAGEFAULT_MINOR;
+        if(fw && (vmarea->vma_flags & MAP_PRIVATE) && NULL == pframe_peek(vmarea->vma_obj, pagenum)
+           && !swap_has(vmarea->vma_obj, pagenum)){
+            kind = PAGEFAULT_COW;
+        }
+        else if(NULL == shadow_resident(vmarea->vma_obj, pagenum)){
+            kind = PAGEFAULT_MAJOR;
+        }
+        int lookUpResult = pframe_lookup(vmarea->vma_obj, pagenum, fw, &pf);
         if(lookUpResult < 0){
             dbg(DBG_PRINT, "(GRADING3A 5)\n");
+            pagefault_account(start, cause, vmarea->vma_obj, PAGEFAULT_FATAL);
             do_exit(EFAULT);
         }
         else{
@@ -98,10 +229,39 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
                 pframe_unpin(pf);
                 dbg(DBG_PRINT, "(GRADING3A 5)\n");
             }
+            if(pframe_rmap_add(pf, curproc->p_pagedir, (uintptr_t) PAGE_ALIGN_DOWN(vaddr)) < 0){
+                dbg(DBG_PRINT, "(GRADING3A 5)\n");
+                pagefault_account(start, cause, pf->pf_obj, PAGEFAULT_FATAL);
+                do_exit(EFAULT);
+            }
             uintptr_t paddr = (uintptr_t) pt_virt_to_phys((uintptr_t) pf->pf_addr);
             int mapResult = pt_map(curproc->p_pagedir, (uintptr_t) PAGE_ALIGN_DOWN(vaddr), paddr, pd, pt);
             tlb_flush((uintptr_t) PAGE_ALIGN_DOWN(vaddr));
             dbg(DBG_PRINT, "(GRADING3A 5)\n");
+            if(!fw && (vmarea->vma_prot & PROT_READ) && vmarea->vma_advice != MADV_RANDOM){
+                fault_around(vmarea, pn);
+            }
+            pagefault_account(start, cause, pf->pf_obj, kind);
+
+            /* read-ahead may allocate, and so reclaim or sleep, which is
+             * only safe now that pf is mapped and reachable through its
+             * reverse mapping; pf must not be used past this point */
+            if(vmarea->vma_advice == MADV_SEQUENTIAL && pn > vmarea->vma_start){
+                /* a sequential reader is done with the page behind it */
+                pframe_t *behind = shadow_resident(vmarea->vma_obj, pagenum - 1);
+                if(behind != NULL){
+                    pframe_deactivate(behind);
+                }
+            }
+            mmobj_t *bottom = mmobj_bottom_obj(vmarea->vma_obj);
+            if(!anon_is_anon(bottom) && vmarea->vma_advice != MADV_RANDOM){
+                /* faulting through a mapped file, let read-ahead see it */
+                if(vmarea->vma_advice == MADV_SEQUENTIAL){
+                    readahead_sequential(bottom, pagenum, pagenum, vmarea->vma_off + vmarea->vma_end - vmarea->vma_start);
+                }else{
+                    readahead_hint(bottom, pagenum, pagenum, vmarea->vma_off + vmarea->vma_end - vmarea->vma_start);
+                }
+            }
         }
         dbg(DBG_PRINT, "(GRADING3A 5)\n");
 
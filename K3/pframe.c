@@ -16,6 +16,7 @@
 #include "mm/pagetable.h"
 
 #include "vm/vmmap.h"
+#include "vm/swap.h"
 
 /*
  * In this file, physical pages (as represented by pframes) will be
@@ -50,8 +51,8 @@
  *
  *
  * When a page is allocated or pinned:
- *     - pf_link links the page into allocated_list or pinned_list,
- *       respectively
+ *     - pf_link links the page into one of the replacement lists
+ *       (recent_list or frequent_list) or into pinned_list, respectively
  *     - pf_hlink links the page into the appropriate hash chain of the
  *       resident page hashtable
  *     - pf_olink links the page into the appropriate mmobj's list of
@@ -74,15 +75,67 @@
 static int npinned;
 static list_t pinned_list;
 
-/*     The ALLOCATED list: */
-/*       Pages on this list contain useful/actual/real data. This list is
- *       maintained in least-recently-requested (via pframe_get or
- *       pframe_get_resident) (and thus, *roughly/approximately* LRU) order.
+/*     The RECENT and FREQUENT lists: */
+/*       Allocated (unpinned) pages contain useful/actual/real data and
+ *       live on one of these two lists, which are managed with a 2Q
+ *       replacement policy:
+ *
+ *       - A page enters the RECENT list (2Q's "A1in") the first time it
+ *         is brought in, and is reclaimed from there in FIFO order.
+ *         Lookups while a page is on RECENT are treated as correlated
+ *         references and do not save it.
+ *       - When a page is reclaimed from RECENT its identity is remembered
+ *         on the GHOST list ("A1out"). A page that is brought back in
+ *         while it is still remembered has proven itself and goes
+ *         straight onto the FREQUENT list ("Am").
+ *       - FREQUENT is reclaimed with CLOCK: a lookup only sets
+ *         PF_REFERENCED, and the reclaimer gives referenced pages another
+ *         trip around the list instead of relinking on every hit.
+ *
+ *       A single large sequential scan therefore cycles through RECENT
+ *       without pushing the working set on FREQUENT out of memory.
+ *       nallocated counts the pages on both lists, nrecent those on
+ *       RECENT alone.
  */
 static int nallocated;
-static list_t alloc_list;
+static int nrecent;
+static list_t recent_list;
+static list_t frequent_list;
+
+/* Replacement state kept in pf_flags next to PF_BUSY and PF_DIRTY. These
+ * bits are private to this file. */
+#define PF_REFERENCED   0x10    /* looked up since the CLOCK hand last passed */
+#define PF_FREQUENT     0x20    /* belongs on frequent_list rather than recent_list */
+#define PF_AGED         0x40    /* user mappings torn down by the aging pass */
+#define PF_WRITEBACK    0x80    /* queued on pageoutd's writeback batch */
+#define PF_CLEANTRIED   0x100   /* already tried by pframe_clean_all() */
+
+/* RECENT is drained first while it holds more than 1/4 of the allocated
+ * pages, the usual 2Q "Kin" share. */
+#define pframe_recent_target()   (nallocated >> 2)
+
+/*     The GHOST list: */
+/*       Identities (object, page number) of pages recently reclaimed from
+ *       RECENT, oldest first, plus a hash for lookup at allocation time.
+ *       The object pointer is only ever compared, never dereferenced, so a
+ *       ghost that outlives its object can at worst promote an unrelated
+ *       page one list early. The list holds at most half as many entries
+ *       as there were free pages at boot.
+ */
+typedef struct pframe_ghost {
+        struct mmobj    *pg_obj;
+        uint32_t         pg_pagenum;
+        list_link_t      pg_link;       /* on ghost_list */
+        list_link_t      pg_hlink;      /* on a ghost_hash chain */
+} pframe_ghost_t;
+
+static int nghosts;
+static int nghosts_max;
+static list_t ghost_list;
+static list_t ghost_hash[PF_HASH_SIZE];
 
 static slab_allocator_t *pframe_allocator;
+static slab_allocator_t *pframe_ghost_allocator;
 
 /* Used to quickly look up pframes. ALL pages "owned by" some
  * mmobj should be in this hash
@@ -91,10 +144,85 @@ static slab_allocator_t *pframe_allocator;
                                   % PF_HASH_SIZE)
 static list_t pframe_hash[PF_HASH_SIZE];
 
+/* Reverse mappings: */
+/*   Every user PTE that handle_pagefault() installs for a page is recorded
+ *   as a (pagedir, vaddr) pair, so that pframe_remove_from_pts() only has to
+ *   visit the page tables that really map the page instead of every vmarea
+ *   of the page's bottom object. Each record is on the pf_rmaps list of its
+ *   page, used to unmap a page everywhere, and in a slot of an rmap table,
+ *   used when an address is remapped or a range of an address space is
+ *   torn down.
+ *
+ *   An rmap table shadows one page table: it has a slot for each of the
+ *   RMAP_TABLE_PAGES pages of one page directory entry's worth of address
+ *   space, and exists only while some page of that space is recorded. The
+ *   tables are found by (pagedir, directory index) through a small hash.
+ *   So the index grows with the address space actually mapped, and a range
+ *   operation visits only the tables that cover the range. A range in which
+ *   nothing is mapped costs one hash lookup per 4MB.
+ */
+#define RMAP_TABLE_PAGES        1024
+#define RMAP_TABLE_HASH_SIZE    64
+
+typedef struct pframe_rmap_table {
+        pagedir_t               *rt_pagedir;
+        uint32_t                 rt_index;      /* first vfn / RMAP_TABLE_PAGES */
+        int                      rt_count;      /* slots in use */
+        list_link_t              rt_link;       /* on an rmap_table_hash chain */
+        struct pframe_rmap      *rt_slots[RMAP_TABLE_PAGES];
+} pframe_rmap_table_t;
+
+typedef struct pframe_rmap {
+        pframe_t                *pr_pf;
+        pagedir_t               *pr_pagedir;
+        uintptr_t                pr_vaddr;      /* page aligned */
+        pframe_rmap_table_t     *pr_table;      /* the table holding it */
+        list_link_t              pr_plink;      /* on pr_pf->pf_rmaps */
+} pframe_rmap_t;
+
+#define hash_rmap_table(pd, index)      ((((uint32_t)(pd) >> 4) + (index)) \
+                                         % RMAP_TABLE_HASH_SIZE)
+static int nrmaps;
+static list_t rmap_table_hash[RMAP_TABLE_HASH_SIZE];
+static slab_allocator_t *pframe_rmap_allocator;
+static slab_allocator_t *pframe_rmap_table_allocator;
+
+/* Pre-zeroed pages: */
+/*   Free pages zeroed ahead of time by the idle loop (see sched_switch), so
+ *   that the fault path can hand out a page of zeros without spending the
+ *   time to clear it. The pool is only refilled while memory is plentiful,
+ *   and handed back to the free list as soon as pageoutd has to run. */
+#define PF_ZERO_POOL_MAX 64
+static void *zero_pool[PF_ZERO_POOL_MAX];
+static int nzero_pool;
+int pframe_zero_pool_hits = 0; /* for debugging/verification purposes */
+int pframe_zero_pool_misses = 0;
+
 /* Related to the Pageout daemon: */
 
+/*   Dirty victims are not cleaned one by one as they come up. pageoutd
+ *   collects up to PF_WRITEBACK_BATCH of them, sorts them by (object, page
+ *   number) and writes each run of consecutive pages of one object with a
+ *   single call to the object's cleanpages operation. Each batched page
+ *   holds a reference on its object so that it cannot be freed out from
+ *   under the batch while pageoutd blocks on another run. */
+#define PF_WRITEBACK_BATCH 32
+static pframe_t *writeback_batch[PF_WRITEBACK_BATCH];
+static int nwriteback;
+
+/*   Free page watermarks. Once the number of free pages drops to
+ *   nfreepages_low, pageoutd is woken up in the background and reclaims
+ *   until nfreepages_high pages are free again. Allocations only stall when
+ *   the free count reaches nfreepages_min. Every such stall means pageoutd
+ *   was started too late for the current workload, so it boosts the low and
+ *   high marks; the boost decays again over passes of pageoutd during which
+ *   nobody had to stall. */
 static uint32_t nfreepages_min = 0;
-static uint32_t nfreepages_target = 0;
+static uint32_t nfreepages_low = 0;
+static uint32_t nfreepages_high = 0;
+static uint32_t nfreepages_boost = 0;
+static uint32_t nfreepages_boost_max = 0;
+static int nalloc_stalls = 0;
 
 /*   pageoutd sleeps on this queue */
 static proc_t *pageoutd = NULL;
@@ -107,17 +235,28 @@ static ktqueue_t alloc_waitq;
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
+static pframe_t *pframe_next_victim(void);
+static int pframe_clean_page(pframe_t *pf);
 #define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
 #define pageoutd_needed()        \
-        ((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
-#define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
+        ((page_free_count() <= nfreepages_low) && (0 < nallocated))
+#define pageoutd_target_met()    (page_free_count() >= nfreepages_high)
+#define pframe_alloc_must_wait() \
+        ((page_free_count() <= nfreepages_min) && (0 < nallocated))
+
+static void
+pframe_set_watermarks(void)
+{
+        nfreepages_low = (nfreepages_min << 1) + nfreepages_boost;
+        nfreepages_high = (nfreepages_min * 3) + nfreepages_boost;
+}
 
 
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
  * slab allocator. You should also list_init all the lists that make
  * up the pframe_hash. Finally, you need to set things up for pageoutd to
- * run by setting nfreepages_min and nfreepages_target.
+ * run by setting the free page watermarks.
  */
 void
 pframe_init(void)
@@ -126,19 +265,43 @@ pframe_init(void)
         npinned = 0;
         list_init(&pinned_list);
         nallocated = 0;
-        list_init(&alloc_list);
+        nrecent = 0;
+        list_init(&recent_list);
+        list_init(&frequent_list);
+        nghosts = 0;
+        list_init(&ghost_list);
 
         pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
         KASSERT(NULL != pframe_allocator);
-
-        /* initialize pframe_hash: */
+        pframe_ghost_allocator = slab_allocator_create("pframe_ghost",
+                                                       sizeof(pframe_ghost_t));
+        KASSERT(NULL != pframe_ghost_allocator);
+        pframe_rmap_allocator = slab_allocator_create("pframe_rmap",
+                                                      sizeof(pframe_rmap_t));
+        KASSERT(NULL != pframe_rmap_allocator);
+        pframe_rmap_table_allocator = slab_allocator_create("pframe_rmap_table",
+                                                            sizeof(pframe_rmap_table_t));
+        KASSERT(NULL != pframe_rmap_table_allocator);
+
+        /* initialize pframe_hash, ghost_hash and the rmap table hash: */
         int i;
-        for (i = 0; i < PF_HASH_SIZE; ++i)
+        for (i = 0; i < PF_HASH_SIZE; ++i) {
                 list_init(&pframe_hash[i]);
+                list_init(&ghost_hash[i]);
+        }
+        for (i = 0; i < RMAP_TABLE_HASH_SIZE; ++i)
+                list_init(&rmap_table_hash[i]);
+        nrmaps = 0;
+        nwriteback = 0;
+        nzero_pool = 0;
+        nghosts_max = page_free_count() >> 1;
 
         /* initialize pageout parameters: */
-        nfreepages_target = page_free_count() >> 1;
-        nfreepages_min = 0;
+        nfreepages_min = MAX(page_free_count() >> 6, 8);
+        nfreepages_boost = 0;
+        nfreepages_boost_max = page_free_count() >> 2;
+        nalloc_stalls = 0;
+        pframe_set_watermarks();
 
         /* initialize alloc_waitq */
         sched_queue_init(&alloc_waitq);
@@ -163,12 +326,115 @@ pframe_shutdown()
 
         /* Free all pages */
         pframe_t *pf;
-        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
-                KASSERT(!pframe_is_dirty(pf));
-                KASSERT(!pframe_is_busy(pf));
-                KASSERT(!pframe_is_pinned(pf));
-                pframe_free(pf);
+        list_t *lists[] = { &recent_list, &frequent_list };
+        int i;
+        for (i = 0; i < 2; ++i) {
+                list_iterate_begin(lists[i], pf, pframe_t, pf_link) {
+                        KASSERT(!pframe_is_dirty(pf));
+                        KASSERT(!pframe_is_busy(pf));
+                        KASSERT(!pframe_is_pinned(pf));
+                        pframe_free(pf);
+                } list_iterate_end();
+        }
+
+        pframe_zero_pool_drain();
+}
+
+/*
+ * Remember the identity of a page that is being reclaimed from the recent
+ * list. When the ghost list is full the oldest entry is recycled.
+ */
+static void
+pframe_ghost_add(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_ghost_t *pg;
+
+        if (nghosts >= nghosts_max) {
+                if (list_empty(&ghost_list))
+                        return;
+                pg = list_head(&ghost_list, pframe_ghost_t, pg_link);
+                list_remove(&pg->pg_link);
+                list_remove(&pg->pg_hlink);
+        } else if (NULL == (pg = slab_obj_alloc(pframe_ghost_allocator))) {
+                return;
+        } else {
+                nghosts++;
+        }
+
+        pg->pg_obj = o;
+        pg->pg_pagenum = pagenum;
+        list_insert_tail(&ghost_list, &pg->pg_link);
+        list_insert_head(&ghost_hash[hash_page(o, pagenum)], &pg->pg_hlink);
+}
+
+/*
+ * Forget the ghost for the given identity, if there is one.
+ *
+ * @return 1 if the page was on the ghost list, 0 otherwise
+ */
+static int
+pframe_ghost_remove(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_ghost_t *pg;
+
+        list_iterate_begin(&ghost_hash[hash_page(o, pagenum)], pg,
+                           pframe_ghost_t, pg_hlink) {
+                if ((o == pg->pg_obj) && (pagenum == pg->pg_pagenum)) {
+                        list_remove(&pg->pg_link);
+                        list_remove(&pg->pg_hlink);
+                        slab_obj_free(pframe_ghost_allocator, pg);
+                        nghosts--;
+                        return 1;
+                }
+        } list_iterate_end();
+
+        return 0;
+}
+
+/*
+ * Put an unpinned page at the tail of the replacement list it belongs on
+ * and account for it.
+ */
+static void
+pframe_enqueue(pframe_t *pf)
+{
+        nallocated++;
+        if (pf->pf_flags & PF_FREQUENT) {
+                list_insert_tail(&frequent_list, &pf->pf_link);
+        } else {
+                nrecent++;
+                list_insert_tail(&recent_list, &pf->pf_link);
+        }
+}
+
+/*
+ * Take an unpinned page off its replacement list.
+ */
+static void
+pframe_dequeue(pframe_t *pf)
+{
+        nallocated--;
+        if (!(pf->pf_flags & PF_FREQUENT))
+                nrecent--;
+        list_remove(&pf->pf_link);
+}
+
+/*
+ * Like pframe_get_resident, but without counting as a reference to the page
+ * for the replacement policy. This is for callers which only want to know
+ * whether a page is in memory (e.g. read-ahead), not to use it.
+ */
+pframe_t *
+pframe_peek(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+
+        list_iterate_begin(&pframe_hash[hash_page(o, pagenum)], pf, pframe_t, pf_hlink) {
+                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum))
+                        return pf;
         } list_iterate_end();
+
+        return NULL;
 }
 
 /*
@@ -189,25 +455,57 @@ pframe_shutdown()
 pframe_t *
 pframe_get_resident(struct mmobj *o, uint32_t pagenum)
 {
-        list_t *hashchain;
         pframe_t *pf;
 
-        hashchain = &pframe_hash[hash_page(o, pagenum)];
-        list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
-                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
-                        /* found a page with the specified identity. It is
-                         * up to the caller to recognize/care if the page
-                         * is busy. */
-                        if (!pframe_is_pinned(pf)) {
-                                /* send to back of alloc_list */
-                                list_remove(&pf->pf_link);
-                                list_insert_tail(&alloc_list, &pf->pf_link);
-                        }
-                        return pf;
-                }
-        } list_iterate_end();
+        /* It is up to the caller to recognize/care if the page is busy. */
+        if (NULL != (pf = pframe_peek(o, pagenum)))
+                pf->pf_flags |= PF_REFERENCED;
 
-        return NULL;
+        return pf;
+}
+
+/*
+ * Count a use of pf that did not come from a lookup, e.g. a user mapping
+ * installed for a page found with pframe_peek(). The page is marked
+ * referenced as pframe_get_resident() would mark it, and since it is about
+ * to be mapped again it is no longer aged (see pframe_age()).
+ */
+void
+pframe_reference(pframe_t *pf)
+{
+        pf->pf_flags |= PF_REFERENCED;
+        pf->pf_flags &= ~PF_AGED;
+}
+
+/*
+ * Returns true if free memory is at or below the low watermark, i.e.
+ * reclaim is underway and speculative allocations (read-ahead) should hold
+ * off.
+ */
+int
+pframe_memory_low(void)
+{
+        return page_free_count() <= nfreepages_low;
+}
+
+/*
+ * Widen [mmo_lopage, mmo_hipage), the span of page numbers o has ever held
+ * a page for, to include pagenum. Anything o puts in swap was resident
+ * first, so the span covers that too. It is never narrowed again; it lets
+ * vmmap_map() see that a range is still all zeros without looking up
+ * every page (see shadow_range_untouched()).
+ */
+static void
+pframe_note_backed(mmobj_t *o, uint32_t pagenum)
+{
+        if (o->mmo_lopage >= o->mmo_hipage) {
+                o->mmo_lopage = pagenum;
+                o->mmo_hipage = pagenum + 1;
+        } else if (pagenum < o->mmo_lopage) {
+                o->mmo_lopage = pagenum;
+        } else if (pagenum >= o->mmo_hipage) {
+                o->mmo_hipage = pagenum + 1;
+        }
 }
 
 /*
@@ -216,7 +514,8 @@ pframe_get_resident(struct mmobj *o, uint32_t pagenum)
  *
  * We allocate a page from the free list. We then initialize the newly allocated
  * page's object, pagenum, and flags, pin count, and links. We also update the
- * object's nrespages.
+ * object's nrespages. The page goes on the recent list, unless its identity is
+ * still on the ghost list, in which case it goes on the frequent list.
  *
  * @param o the mmobj identifying this page
  * @param pagenum the page number of this page in the object
@@ -237,13 +536,15 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
                 return NULL;
         }
 
-        nallocated++;
-        list_insert_tail(&alloc_list, &pf->pf_link);
-
         pf->pf_obj = o;
         pf->pf_pagenum = pagenum;
         pf->pf_flags = 0;
         sched_queue_init(&pf->pf_waitq);
+        list_init(&pf->pf_rmaps);
+
+        if (pframe_ghost_remove(o, pagenum))
+                pf->pf_flags |= PF_FREQUENT;
+        pframe_enqueue(pf);
         pf->pf_pincount = 0;
 
         list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
@@ -251,6 +552,7 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         o->mmo_ops->ref(o);
         o->mmo_nrespages++;
         list_insert_head(&o->mmo_respages, &pf->pf_olink);
+        pframe_note_backed(o, pagenum);
 
         return pf;
 }
@@ -267,7 +569,10 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
 /*
  * Migrate a page frame up the tree. The destination must be on the same
  * branch as the pframe's current object. pf must not be busy. If dest
- * already has a page with the same number as pf clean pf.
+ * already has a page with the same number as pf (resident or in swap), pf
+ * is obsolete and is simply dropped. Otherwise pf moves to dest; any swap
+ * copy belonging to the old object is released and the page is marked
+ * dirty, since dest has no copy of it anywhere else.
  *
  * @param pf page to be migrated
  * @param dest destination vm object
@@ -276,13 +581,17 @@ void
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
         KASSERT(!pframe_is_busy(pf));
-        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)) {
-                /* dest already has a newer version of the page, clean this page */
-                pframe_unpin(pf);
-                pframe_clean(pf);
+        if ((NULL != pframe_get_resident(dest, pf->pf_pagenum))
+            || swap_has(dest, pf->pf_pagenum)) {
+                /* dest already has a newer version of the page, drop this page */
+                if (pframe_is_pinned(pf))
+                        pframe_unpin(pf);
+                swap_forget(pf->pf_obj, pf->pf_pagenum);
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
+                swap_forget(src, pf->pf_pagenum);
+                pframe_set_dirty(pf);
                 pf->pf_obj = dest;
                 list_remove(&pf->pf_hlink);
                 list_remove(&pf->pf_olink);
@@ -292,6 +601,7 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
                 list_insert_head(&dest->mmo_respages, &pf->pf_olink);
                 dest->mmo_nrespages++;
                 dest->mmo_ops->ref(dest);
+                pframe_note_backed(dest, pf->pf_pagenum);
         }
 }
 
@@ -314,6 +624,82 @@ pframe_fill(pframe_t *pf)
         return ret;
 }
 
+/*
+ * Take one clean, unpinned, non-busy page from the replacement policy and
+ * free it without blocking. This is the allocating thread's share of the
+ * reclaim work when the free list is at its minimum; dirty pages are left
+ * for pageoutd, since cleaning them may block and may need to allocate.
+ *
+ * @return 1 if a page was freed, 0 if the victim could not be taken
+ */
+static int
+pframe_reclaim_clean(void)
+{
+        pframe_t *pf;
+
+        if (NULL == (pf = pframe_next_victim()))
+                return 0;
+        if (pframe_is_busy(pf) || pframe_is_dirty(pf)
+            || (pf->pf_flags & PF_WRITEBACK))
+                return 0;
+
+        if (!(pf->pf_flags & PF_FREQUENT))
+                pframe_ghost_add(pf->pf_obj, pf->pf_pagenum);
+        pframe_free(pf);
+        return 1;
+}
+
+/*
+ * Called by pframe_get() before it takes a page from the free list.
+ *
+ * At the low watermark pageoutd is kicked, but the caller goes on
+ * allocating. At the min watermark the caller first tries direct reclaim;
+ * only if that fails does it boost the watermarks and sleep until pageoutd
+ * has brought the free count back above the low watermark. Waiters are
+ * released one at a time: each one that wakes up with memory still short
+ * kicks pageoutd and goes back to sleep, and the one that finds enough
+ * free passes the wakeup on to the next waiter.
+ *
+ * pageoutd itself is never throttled, since it may have to allocate (e.g.
+ * indirect blocks) to clean pages.
+ *
+ * @return 0 if the caller may allocate, or -ENOMEM if its thread was
+ * cancelled while it waited for memory
+ */
+static int
+pframe_throttle(void)
+{
+        if (curthr == pageoutd_thr)
+                return 0;
+
+        if (pageoutd_needed()) {
+                pframe_zero_pool_drain();
+                pageoutd_wakeup();
+        }
+
+        if (!pframe_alloc_must_wait() || pframe_reclaim_clean())
+                return 0;
+
+        nalloc_stalls++;
+        if (nfreepages_boost < nfreepages_boost_max) {
+                nfreepages_boost = MIN(nfreepages_boost + nfreepages_min,
+                                       nfreepages_boost_max);
+                pframe_set_watermarks();
+        }
+
+        while (pageoutd_needed()) {
+                pageoutd_wakeup();
+                if (sched_cancellable_sleep_on(&alloc_waitq)) {
+                        /* don't swallow a wakeup meant for the next waiter */
+                        sched_wakeup_on(&alloc_waitq);
+                        return -ENOMEM;
+                }
+        }
+
+        sched_wakeup_on(&alloc_waitq);
+        return 0;
+}
+
 /*
  * Find and return the pframe representing the page identified by the object
  * and page number. If the page is already resident in memory, then we return
@@ -342,18 +728,32 @@ pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
         //return 0;
     *result = pframe_get_resident(o, pagenum);
 
+again:
+    /* the page may be filled asynchronously, and freed again if that
+     * fails, so look it up again after every wait */
+    while(*result && pframe_is_busy(*result)){
+        sched_sleep_on(&((*result)->pf_waitq));
+        dbg(DBG_PRINT, "(GRADING3A 1)\n");
+        *result = pframe_get_resident(o, pagenum);
+    }
+
     if(*result){
-        if(pframe_is_busy(*result)){
-            sched_sleep_on(&((*result)->pf_waitq));
-            dbg(DBG_PRINT, "(GRADING3A 1)\n");
-        }
         dbg(DBG_PRINT, "(GRADING3A 1)\n");
     } 
     else{
+        int throttled = pframe_throttle();
+        if(throttled < 0){
+            dbg(DBG_PRINT, "(GRADING3A 1.a)\n");
+            return throttled;
+        }
+        /* someone may have brought the page in while we were throttled */
+        if(NULL != (*result = pframe_get_resident(o, pagenum))){
+            dbg(DBG_PRINT, "(GRADING3A 1)\n");
+            goto again;
+        }
         *result = pframe_alloc(o, pagenum);
 
         if(*result == NULL){
-            KASSERT(NULL != *result);
             dbg(DBG_PRINT, "(GRADING3A 1.a)\n");
             return -ENOMEM;
         } 
@@ -400,9 +800,8 @@ pframe_pin(pframe_t *pf)
     dbg(DBG_PRINT, "(GRADING3A 1.b)\n");
     
     if(pframe_is_pinned(pf) == 0){
-        list_remove(&pf->pf_link);
+        pframe_dequeue(pf);
         list_insert_tail(&pinned_list, &pf->pf_link);
-        nallocated=nallocated-1;
         npinned=npinned+1;
         dbg(DBG_PRINT, "(GRADING3A 1)\n");
     }
@@ -434,8 +833,7 @@ pframe_unpin(pframe_t *pf)
     pf->pf_pincount = pf->pf_pincount-1;
     if (pf->pf_pincount == 0){
         list_remove(&pf->pf_link);
-        list_insert_tail(&alloc_list, &pf->pf_link);
-        nallocated=nallocated+1;
+        pframe_enqueue(pf);
         npinned=npinned-1;
         dbg(DBG_PRINT, "(GRADING3A 1)\n");
     }
@@ -485,11 +883,22 @@ pframe_dirty(pframe_t *pf)
  */
 int
 pframe_clean(pframe_t *pf)
+{
+        KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
+
+        return pframe_clean_page(pf);
+}
+
+/*
+ * pframe_clean() without the check that the page is unpinned, for
+ * pframe_clean_range(), which pins the pages it is about to clean itself.
+ */
+static int
+pframe_clean_page(pframe_t *pf)
 {
         int ret;
 
         KASSERT(pframe_is_dirty(pf) && "Cleaning page that isn't dirty!");
-        KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
 
         dbg(DBG_PFRAME, "cleaning page %d of obj %p\n", pf->pf_pagenum, pf->pf_obj);
 
@@ -539,12 +948,12 @@ pframe_free(pframe_t *pf)
         tlb_flush((uintptr_t) pf->pf_addr);
         /* Remove from all pagetables that map it */
         pframe_remove_from_pts(pf);
+        KASSERT(list_empty(&pf->pf_rmaps));
 
         list_remove(&pf->pf_hlink);
 
         pf->pf_obj = NULL;
-        nallocated--;
-        list_remove(&pf->pf_link);
+        pframe_dequeue(pf);
 
         page_free(pf->pf_addr);
         slab_obj_free(pframe_allocator, pf);
@@ -558,6 +967,84 @@ pframe_free(pframe_t *pf)
         o->mmo_ops->put(o);
 }
 
+/*
+ * Throw away the page identified by 'o' and 'pagenum', if it is resident,
+ * together with all of its user mappings and without writing it back, so
+ * that the object no longer has the page in memory. Any swap copy is the
+ * caller's business. This is how madvise(MADV_DONTNEED) drops pages.
+ *
+ * Waits for the page if it is busy or on pageoutd's writeback batch.
+ * Pinned pages are left alone.
+ *
+ * @return 0 if the page is not resident (anymore), -EBUSY if it is pinned
+ */
+int
+pframe_discard(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+
+        while (NULL != (pf = pframe_peek(o, pagenum))) {
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                } else if (pf->pf_flags & PF_WRITEBACK) {
+                        /* no point writing it any more; pageoutd lets go
+                         * of it once the rest of the batch is written */
+                        pframe_clear_dirty(pf);
+                        sched_sleep_on(&pf->pf_waitq);
+                } else if (pframe_is_pinned(pf)) {
+                        return -EBUSY;
+                } else {
+                        pframe_clear_dirty(pf);
+                        pframe_free(pf);
+                }
+        }
+        return 0;
+}
+
+/*
+ * Put an unpinned page at the head of the recent list, where it is the
+ * next page the replacement policy gives up, and forget anything that
+ * promoted it. Used for pages a process has said it will not need again
+ * soon (MADV_SEQUENTIAL, MADV_FREE). Busy, pinned and queued pages are
+ * left where they are.
+ */
+void
+pframe_deactivate(pframe_t *pf)
+{
+        if (pframe_is_busy(pf) || pframe_is_pinned(pf)
+            || (pf->pf_flags & PF_WRITEBACK))
+                return;
+
+        pframe_dequeue(pf);
+        pf->pf_flags &= ~(PF_FREQUENT | PF_REFERENCED | PF_AGED);
+        nallocated++;
+        nrecent++;
+        list_insert_head(&recent_list, &pf->pf_link);
+}
+
+/*
+ * Let the replacement policy reclaim a page without writing it back
+ * (MADV_FREE): the dirty bit is cleared and the page deactivated. The
+ * caller must then drop any swap copy, and must write-protect the page's
+ * mappings so that a later write faults and dirties the page again, at
+ * which point it is kept after all. Busy, pinned and queued pages are
+ * left alone, as in pframe_deactivate().
+ *
+ * @return 1 if the page may now be dropped, 0 if it was left alone (and
+ * its swap copy, if any, must be kept)
+ */
+int
+pframe_lazyfree(pframe_t *pf)
+{
+        if (pframe_is_busy(pf) || pframe_is_pinned(pf)
+            || (pf->pf_flags & PF_WRITEBACK))
+                return 0;
+
+        pframe_clear_dirty(pf);
+        pframe_deactivate(pf);
+        return 1;
+}
+
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
  * not free). This is called by sync(2).
@@ -568,26 +1055,41 @@ pframe_clean_all()
         pframe_t *pf;
         dbg(DBG_PFRAME, "pframe_clean_all: starting (this may take a while)\n");
 
+        list_t *lists[] = { &recent_list, &frequent_list };
+        int i;
+
         /*
-         * Iterate from head of alloc_list to tail; This is a rough attempt to
-         * sync from least active to most active. Note that every time we block we
-         * need to start the loop over as the "current element" pf may have been
-         * moved or removed in the meantime (our list has no multithreaded
-         * integrity)
+         * Iterate from head of the recent list to the tail of the frequent
+         * list; This is a rough attempt to sync from least active to most
+         * active. Note that every time we block we need to start the loop
+         * over as the "current element" pf may have been moved or removed in
+         * the meantime (our lists have no multithreaded integrity)
          */
 list_start:
-        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
-                KASSERT(!pframe_is_pinned(pf));
-                KASSERT(!pframe_is_free(pf));
-                if (pframe_is_busy(pf)) {
-                        sched_sleep_on(&pf->pf_waitq);
-                        goto list_start;
-                }
-                if (pframe_is_dirty(pf)) {
-                        pframe_clean(pf);
-                        goto list_start;
-                }
-        } list_iterate_end();
+        for (i = 0; i < 2; ++i) {
+                list_iterate_begin(lists[i], pf, pframe_t, pf_link) {
+                        KASSERT(!pframe_is_pinned(pf));
+                        KASSERT(!pframe_is_free(pf));
+                        if (pframe_is_busy(pf)) {
+                                sched_sleep_on(&pf->pf_waitq);
+                                goto list_start;
+                        }
+                        if (pframe_is_dirty(pf) && !(pf->pf_flags & PF_CLEANTRIED)) {
+                                /* a page whose clean fails (e.g. anonymous
+                                 * memory without swap) stays dirty; don't
+                                 * retry it forever */
+                                pf->pf_flags |= PF_CLEANTRIED;
+                                pframe_clean(pf);
+                                goto list_start;
+                        }
+                } list_iterate_end();
+        }
+
+        for (i = 0; i < 2; ++i) {
+                list_iterate_begin(lists[i], pf, pframe_t, pf_link) {
+                        pf->pf_flags &= ~PF_CLEANTRIED;
+                } list_iterate_end();
+        }
 
         /* In theory, this function might never terminate (if new pages are
          * constantly being added at the same time). That's why the user shouldn't
@@ -595,25 +1097,500 @@ list_start:
         dbg(DBG_PFRAME, "pframe_clean_all: completed!\n");
 }
 
-/* Remove a page frame from the page tables of all processes that map it
- * To do that, traverse all processes that map the given page frame into
- * their address space, and zero the corresponding address entry.
+/* ------------------------------------------------------------------ */
+/* ------------------------ PRE-ZEROED PAGES ------------------------ */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Zero one more page for the pool. This is called from the idle loop when
+ * there is nothing to run, one page at a time so that the run queue is
+ * looked at again between pages.
+ *
+ * @return 1 if a page was zeroed, 0 if the pool is full or memory is short
+ */
+int
+pframe_zero_pool_refill(void)
+{
+        void *page;
+
+        if ((PF_ZERO_POOL_MAX == nzero_pool)
+            || (page_free_count() <= nfreepages_high))
+                return 0;
+        if (NULL == (page = page_alloc()))
+                return 0;
+
+        memset(page, 0, PAGE_SIZE);
+        zero_pool[nzero_pool++] = page;
+        return 1;
+}
+
+/*
+ * Give all the pages of the pool back to the free list.
  */
 void
-pframe_remove_from_pts(pframe_t *pf)
+pframe_zero_pool_drain(void)
+{
+        while (0 < nzero_pool)
+                page_free(zero_pool[--nzero_pool]);
+}
+
+/*
+ * Allocate a page of zeros, from the pool if possible.
+ *
+ * @return the page, or NULL if we are out of memory
+ */
+void *
+pframe_alloc_zeroed_page(void)
+{
+        void *page;
+
+        if (0 < nzero_pool) {
+                pframe_zero_pool_hits++;
+                return zero_pool[--nzero_pool];
+        }
+
+        pframe_zero_pool_misses++;
+        if (NULL != (page = page_alloc()))
+                memset(page, 0, PAGE_SIZE);
+        return page;
+}
+
+/*
+ * Fill pf with zeros. If the pool has a page, pf simply trades its frame
+ * for it. pf must be busy and must not be mapped anywhere yet, i.e. this
+ * is meant for fillpage.
+ */
+void
+pframe_zero(pframe_t *pf)
+{
+        KASSERT(pframe_is_busy(pf));
+
+        if (0 < nzero_pool) {
+                pframe_zero_pool_hits++;
+                page_free(pf->pf_addr);
+                pf->pf_addr = zero_pool[--nzero_pool];
+        } else {
+                pframe_zero_pool_misses++;
+                memset(pf->pf_addr, 0, PAGE_SIZE);
+        }
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------ ASYNCHRONOUS FILL ----------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * pframe_get() fills a missing page in the calling thread, so a thread can
+ * only ever have one page-in outstanding. pframe_get_async() instead hands
+ * the fill to one of PF_NFILLERS filler daemons and returns at once with
+ * the page still busy. Since block I/O blocks only the thread that issued
+ * it, up to PF_NFILLERS page-ins can be in flight at the same time.
+ *
+ * A caller that wants to know when its page-ins are done passes the same
+ * completion to each pframe_get_async() call, then waits for all of them at
+ * once with pframe_completion_wait(). Anyone else who wants one of the
+ * pages just calls pframe_get(), which sleeps on the busy page as usual.
+ */
+#define PF_NFILLERS 4
+
+typedef struct pframe_fillreq {
+        pframe_t                *fr_pf;
+        pframe_completion_t     *fr_pc;
+        list_link_t              fr_link;
+} pframe_fillreq_t;
+
+static slab_allocator_t *pframe_fillreq_allocator;
+static list_t fill_queue;
+static ktqueue_t fillerd_waitq;
+static proc_t *fillerd[PF_NFILLERS];
+static kthread_t *fillerd_thr[PF_NFILLERS];
+static int fillerd_stopped;
+
+static void *fillerd_run(int arg1, void *arg2);
+
+static __attribute__((unused)) void
+fillerd_init(void)
+{
+        int i;
+
+        pframe_fillreq_allocator = slab_allocator_create("pframe_fillreq",
+                                                         sizeof(pframe_fillreq_t));
+        KASSERT(NULL != pframe_fillreq_allocator);
+        list_init(&fill_queue);
+        sched_queue_init(&fillerd_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        for (i = 0; i < PF_NFILLERS; ++i) {
+                fillerd[i] = proc_create("fillerd");
+                KASSERT(NULL != fillerd[i]);
+                fillerd_thr[i] = kthread_create(fillerd[i], fillerd_run, 0, NULL);
+                KASSERT(NULL != fillerd_thr[i]);
+                sched_make_runnable(fillerd_thr[i]);
+        }
+}
+init_func(fillerd_init);
+init_depends(sched_init);
+
+/*
+ * Stop the filler daemons and wait for them. A cancelled filler still
+ * drains the queue before it exits, and once they are stopped
+ * pframe_get_async() fills pages synchronously, so nothing is left busy.
+ * Called from idleproc before the VFS is shut down, since the pages being
+ * filled hold references on their objects.
+ */
+void
+pframe_fillers_shutdown(void)
+{
+        int i;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        fillerd_stopped = 1;
+        for (i = 0; i < PF_NFILLERS; ++i) {
+                KASSERT(NULL != fillerd_thr[i]);
+                kthread_cancel(fillerd_thr[i], (void *) 0);
+                fillerd_thr[i] = NULL;
+        }
+        for (i = 0; i < PF_NFILLERS; ++i) {
+                int pid = fillerd[i]->p_pid;
+                int child = do_waitpid(pid, 0, NULL);
+                KASSERT(pid == child && "waited on process other than fillerd");
+        }
+}
+
+void
+pframe_completion_init(pframe_completion_t *pc)
+{
+        pc->pc_pending = 0;
+        pc->pc_error = 0;
+        sched_queue_init(&pc->pc_waitq);
+}
+
+/*
+ * Wait until every page-in started against pc has finished.
+ *
+ * @return 0, or the error of the first page-in that failed
+ */
+int
+pframe_completion_wait(pframe_completion_t *pc)
+{
+        while (0 < pc->pc_pending)
+                sched_sleep_on(&pc->pc_waitq);
+        return pc->pc_error;
+}
+
+/*
+ * Finish a page-in: wake up anyone waiting on the page, account for it in
+ * its completion (if any), and drop the page if it could not be filled.
+ */
+static void
+pframe_fill_done(pframe_t *pf, pframe_completion_t *pc, int ret)
+{
+        pframe_clear_busy(pf);
+        sched_broadcast_on(&pf->pf_waitq);
+
+        if (NULL != pc) {
+                if ((ret < 0) && (0 == pc->pc_error))
+                        pc->pc_error = ret;
+                KASSERT(0 < pc->pc_pending);
+                if (0 == --pc->pc_pending)
+                        sched_broadcast_on(&pc->pc_waitq);
+        }
+
+        if (ret < 0)
+                pframe_free(pf);
+}
+
+/*
+ * Start bringing in the page identified by the object and page number, and
+ * return without waiting for it.
+ *
+ * If the page is already resident it is returned as it is (it may be busy
+ * being filled by someone else) and pc is not involved. Otherwise a new
+ * page is allocated, marked busy, and queued for the filler daemons; pc, if
+ * not NULL, counts it as pending until it has been filled. A queued page
+ * holds a reference on o until its fill is done. If no fill
+ * request can be allocated, or the fillers have been stopped, the page is
+ * filled synchronously instead.
+ *
+ * The returned page may be busy, and may be freed if its fill fails, so it
+ * is only good for as long as the caller does not block. To use it, wait
+ * for pc and then pframe_get() the page.
+ *
+ * @param o the parent object of the page
+ * @param pagenum the page number of this page in the object
+ * @param pc completion to account the page-in to, or NULL
+ * @param result used to return the pframe (NULL if there's an error)
+ * @return 0 on success, < 0 on failure.
+ */
+int
+pframe_get_async(struct mmobj *o, uint32_t pagenum, pframe_completion_t *pc,
+                 pframe_t **result)
+{
+        pframe_fillreq_t *fr;
+        pframe_t *pf;
+        int ret;
+
+        if (NULL != (*result = pframe_get_resident(o, pagenum)))
+                return 0;
+
+        if (0 > (ret = pframe_throttle()))
+                return ret;
+        if (NULL != (*result = pframe_get_resident(o, pagenum)))
+                return 0;
+        if (NULL == (pf = pframe_alloc(o, pagenum)))
+                return -ENOMEM;
+
+        pframe_set_busy(pf);
+        if (NULL != pc)
+                pc->pc_pending++;
+
+        if (fillerd_stopped
+            || (NULL == (fr = slab_obj_alloc(pframe_fillreq_allocator)))) {
+                ret = o->mmo_ops->fillpage(o, pf);
+                pframe_fill_done(pf, pc, ret);
+                *result = (ret < 0) ? NULL : pf;
+                return (ret < 0) ? -EFAULT : 0;
+        }
+
+        /* the caller may drop its reference to o before the fill is done */
+        o->mmo_ops->ref(o);
+        fr->fr_pf = pf;
+        fr->fr_pc = pc;
+        list_insert_tail(&fill_queue, &fr->fr_link);
+        sched_wakeup_on(&fillerd_waitq);
+
+        *result = pf;
+        return 0;
+}
+
+/*
+ * A filler daemon takes fill requests off the queue and fills their pages
+ * one at a time, then sleeps until more are queued. When cancelled it only
+ * exits once the queue is empty.
+ * Both arguments unused.
+ */
+static void *
+fillerd_run(int arg1, void *arg2)
+{
+        while (1) {
+                while (!list_empty(&fill_queue)) {
+                        pframe_fillreq_t *fr = list_head(&fill_queue, pframe_fillreq_t, fr_link);
+                        pframe_t *pf = fr->fr_pf;
+                        pframe_completion_t *pc = fr->fr_pc;
+                        mmobj_t *o = pf->pf_obj;
+                        int ret;
+
+                        list_remove(&fr->fr_link);
+                        slab_obj_free(pframe_fillreq_allocator, fr);
+
+                        ret = o->mmo_ops->fillpage(o, pf);
+                        dbg(DBG_PFRAME, "filled page %d of obj %p (%d)\n",
+                            pf->pf_pagenum, o, ret);
+                        pframe_fill_done(pf, pc, ret);
+                        o->mmo_ops->put(o);
+                }
+
+                if (sched_cancellable_sleep_on(&fillerd_waitq)
+                    && list_empty(&fill_queue))
+                        kthread_exit((void *) 0);
+        }
+        return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------- REVERSE MAPPING ------------------------ */
+/* ------------------------------------------------------------------ */
+
+static pframe_rmap_table_t *
+pframe_rmap_table_find(pagedir_t *pd, uint32_t index)
 {
-        vmarea_t *vma;
-        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
-                /* Get the virtual address in the area corresponding to this pf */
-                if ((pf->pf_pagenum >= vma->vma_off)
-                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))) {
-                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
-                        /* And unmap it from that area's proc */
-                        if (NULL != vma->vma_vmmap->vmm_proc) {
-                                pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
+        pframe_rmap_table_t *rt;
+
+        list_iterate_begin(&rmap_table_hash[hash_rmap_table(pd, index)], rt,
+                           pframe_rmap_table_t, rt_link) {
+                if ((pd == rt->rt_pagedir) && (index == rt->rt_index))
+                        return rt;
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static pframe_rmap_t *
+pframe_rmap_find(pagedir_t *pd, uintptr_t vaddr)
+{
+        uint32_t vfn = ADDR_TO_PN(vaddr);
+        pframe_rmap_table_t *rt = pframe_rmap_table_find(pd, vfn / RMAP_TABLE_PAGES);
+
+        return (NULL == rt) ? NULL : rt->rt_slots[vfn % RMAP_TABLE_PAGES];
+}
+
+/*
+ * Remap the page of a reverse mapping read-only.
+ */
+static void
+pframe_rmap_wrprotect(pframe_rmap_t *pr)
+{
+        pt_map(pr->pr_pagedir, pr->pr_vaddr,
+               pt_virt_to_phys((uintptr_t) pr->pr_pf->pf_addr),
+               PD_PRESENT | PD_USER | PD_WRITE, PT_PRESENT | PT_USER);
+}
+
+/*
+ * Returns the page mapped at vaddr in the page directory pd, or NULL if
+ * nothing is mapped there.
+ */
+pframe_t *
+pframe_rmap_lookup(pagedir_t *pd, uintptr_t vaddr)
+{
+        pframe_rmap_t *pr = pframe_rmap_find(pd, vaddr);
+
+        return (NULL == pr) ? NULL : pr->pr_pf;
+}
+
+/* Drop a record, and its table too if that was the table's last record. */
+static void
+pframe_rmap_free(pframe_rmap_t *pr)
+{
+        pframe_rmap_table_t *rt = pr->pr_table;
+
+        list_remove(&pr->pr_plink);
+        rt->rt_slots[ADDR_TO_PN(pr->pr_vaddr) % RMAP_TABLE_PAGES] = NULL;
+        slab_obj_free(pframe_rmap_allocator, pr);
+        nrmaps--;
+
+        if (0 == --rt->rt_count) {
+                list_remove(&rt->rt_link);
+                slab_obj_free(pframe_rmap_table_allocator, rt);
+        }
+}
+
+/*
+ * Call fn on each reverse mapping of the user range [vlow, vhigh) of pd.
+ * Only the tables covering the range are visited, and within a table we
+ * stop as soon as all its records have been seen. fn may free the record
+ * it is given (and with the last one, the table).
+ */
+static void
+pframe_rmap_walk(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh,
+                 void (*fn)(pframe_rmap_t *))
+{
+        uint32_t vfn = ADDR_TO_PN(vlow);
+        uint32_t hi = ADDR_TO_PN(vhigh);
+
+        while (vfn < hi) {
+                uint32_t end = MIN((vfn / RMAP_TABLE_PAGES + 1) * RMAP_TABLE_PAGES, hi);
+                pframe_rmap_table_t *rt = pframe_rmap_table_find(pd, vfn / RMAP_TABLE_PAGES);
+
+                if (NULL != rt) {
+                        int left = rt->rt_count;
+                        pframe_rmap_t *pr;
+
+                        for (; vfn < end; ++vfn) {
+                                if (NULL == (pr = rt->rt_slots[vfn % RMAP_TABLE_PAGES]))
+                                        continue;
+                                fn(pr);
+                                if (0 == --left)
+                                        break;
                         }
                 }
+                vfn = end;
+        }
+}
 
+/*
+ * Record that the user page at 'vaddr' in 'pd' maps pf. This must be called
+ * for every user PTE that is installed for a pframe. If the address was
+ * already recorded as mapping some other page (e.g. a copy-on-write fault
+ * replacing a read-only mapping of an ancestor's page), the old record is
+ * reused for pf.
+ *
+ * @param pf the page that was mapped
+ * @param pd the page directory it was mapped into
+ * @param vaddr the (page aligned) user address it was mapped at
+ * @return 0 on success, -ENOMEM if the record could not be allocated
+ */
+int
+pframe_rmap_add(pframe_t *pf, pagedir_t *pd, uintptr_t vaddr)
+{
+        uint32_t vfn = ADDR_TO_PN(vaddr);
+        pframe_rmap_table_t *rt;
+        pframe_rmap_t *pr;
+
+        KASSERT(PAGE_ALIGNED(vaddr));
+
+        if (NULL == (rt = pframe_rmap_table_find(pd, vfn / RMAP_TABLE_PAGES))) {
+                if (NULL == (rt = slab_obj_alloc(pframe_rmap_table_allocator)))
+                        return -ENOMEM;
+                memset(rt->rt_slots, 0, sizeof(rt->rt_slots));
+                rt->rt_pagedir = pd;
+                rt->rt_index = vfn / RMAP_TABLE_PAGES;
+                rt->rt_count = 0;
+                list_insert_head(&rmap_table_hash[hash_rmap_table(pd, rt->rt_index)],
+                                 &rt->rt_link);
+        }
+
+        if (NULL != (pr = rt->rt_slots[vfn % RMAP_TABLE_PAGES])) {
+                if (pf == pr->pr_pf)
+                        return 0;
+                list_remove(&pr->pr_plink);
+        } else {
+                if (NULL == (pr = slab_obj_alloc(pframe_rmap_allocator))) {
+                        if (0 == rt->rt_count) {
+                                list_remove(&rt->rt_link);
+                                slab_obj_free(pframe_rmap_table_allocator, rt);
+                        }
+                        return -ENOMEM;
+                }
+                pr->pr_pagedir = pd;
+                pr->pr_vaddr = vaddr;
+                pr->pr_table = rt;
+                rt->rt_slots[vfn % RMAP_TABLE_PAGES] = pr;
+                rt->rt_count++;
+                nrmaps++;
+        }
+
+        pr->pr_pf = pf;
+        list_insert_head(&pf->pf_rmaps, &pr->pr_plink);
+        return 0;
+}
+
+/*
+ * Forget the reverse mappings for the user range [vlow, vhigh) of 'pd'.
+ * This does not touch the page tables themselves; it must be called
+ * whenever the caller unmaps such a range with pt_unmap_range() or is about
+ * to destroy the page directory, so that no record outlives its PTE.
+ */
+void
+pframe_rmap_remove(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
+{
+        pframe_rmap_walk(pd, vlow, vhigh, pframe_rmap_free);
+}
+
+/*
+ * Make every mapping of the user range [vlow, vhigh) of 'pd' read-only,
+ * leaving the pages mapped. This is how fork sets up copy-on-write for the
+ * parent's private areas: reads keep hitting the existing PTEs and only a
+ * write faults. The caller must flush the TLB afterwards.
+ */
+void
+pframe_rmap_protect(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
+{
+        pframe_rmap_walk(pd, vlow, vhigh, pframe_rmap_wrprotect);
+}
+
+/* Remove a page frame from the page tables of all processes that map it.
+ * The page's reverse mappings tell us exactly which (pagedir, vaddr) pairs
+ * map it, so unmap each of those and drop its record.
+ */
+void
+pframe_remove_from_pts(pframe_t *pf)
+{
+        pframe_rmap_t *pr;
+
+        list_iterate_begin(&pf->pf_rmaps, pr, pframe_rmap_t, pr_plink) {
+                pt_unmap(pr->pr_pagedir, pr->pr_vaddr);
+                pframe_rmap_free(pr);
         } list_iterate_end();
 }
 
@@ -657,50 +1634,347 @@ pageoutd_exit()
 }
 
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
+ * Page aging for user-mapped pages.
+ *
+ * User code touches pages through the PTEs that handle_pagefault()
+ * installed, and those accesses never go through pframe_get_resident(), so
+ * PF_REFERENCED alone only reflects kernel lookups. To see user accesses
+ * the aging pass harvests them the way a hardware accessed bit would be
+ * harvested: it tears down every user mapping of an unreferenced page and
+ * sets PF_AGED. The next user access then faults, the fault looks the page
+ * up, and the lookup sets PF_REFERENCED. A page that comes around to the
+ * CLOCK hand again still aged and unreferenced has not been touched by
+ * anyone for a full trip around the list and is a real victim.
+ *
+ * @param pf an unreferenced page on the frequent list
+ * @return 1 if the page was just armed and deserves another trip, 0 if it
+ * was already aged and may be reclaimed
+ */
+static int
+pframe_age(pframe_t *pf)
+{
+        if (pf->pf_flags & PF_AGED)
+                return 0;
+
+        pf->pf_flags |= PF_AGED;
+        pframe_remove_from_pts(pf);
+        return 1;
+}
+
+/*
+ * Choose the next page to reclaim. The recent list is drained in FIFO order
+ * while it holds more than its target share of the allocated pages (or when
+ * the frequent list is empty). Otherwise the CLOCK hand sweeps the frequent
+ * list: a page with PF_REFERENCED set has the bit cleared and is rotated to
+ * the tail, an unreferenced page that has not been aged yet is aged (see
+ * pframe_age) and rotated, and the first unreferenced, aged page is chosen.
+ * The sweep ends after at most three trips around the list.
+ *
+ * @return the chosen page, which may be busy or dirty, or NULL if there are
+ * no allocated pages
+ */
+static pframe_t *
+pframe_next_victim(void)
+{
+        pframe_t *pf;
+
+        if (!list_empty(&recent_list)
+            && ((nrecent > pframe_recent_target()) || list_empty(&frequent_list)))
+                return list_head(&recent_list, pframe_t, pf_link);
+
+        while (!list_empty(&frequent_list)) {
+                pf = list_head(&frequent_list, pframe_t, pf_link);
+                if (pf->pf_flags & PF_REFERENCED) {
+                        /* used since the last pass; any user mapping torn
+                         * down by aging has been re-established */
+                        pf->pf_flags &= ~(PF_REFERENCED | PF_AGED);
+                } else if (!pframe_age(pf)) {
+                        return pf;
+                }
+                list_remove(&pf->pf_link);
+                list_insert_tail(&frequent_list, &pf->pf_link);
+        }
+
+        return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* ---------------------------- WRITEBACK --------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Queue a dirty victim for writeback. The page is rotated to the tail of
+ * its list so that the replacement policy moves on to the next victim.
+ */
+static void
+pframe_writeback_add(pframe_t *pf)
+{
+        KASSERT(nwriteback < PF_WRITEBACK_BATCH);
+        KASSERT(!(pf->pf_flags & PF_WRITEBACK));
+
+        pf->pf_flags |= PF_WRITEBACK;
+        pf->pf_obj->mmo_ops->ref(pf->pf_obj);
+        writeback_batch[nwriteback++] = pf;
+
+        pframe_dequeue(pf);
+        pframe_enqueue(pf);
+}
+
+/* pins is the number of pins the caller itself holds on the page */
+#define pframe_writeback_ok(pf, pins)                                   \
+        (pframe_is_dirty(pf) && !pframe_is_busy(pf) && ((pins) == (pf)->pf_pincount))
+
+/*
+ * Clean a run of consecutive pages of one object. If the object has a
+ * cleanpages operation and every page of the run can still be cleaned, the
+ * run is written with a single call; otherwise the pages that still need
+ * it are cleaned one at a time. Like pframe_clean(), the dirty bits are
+ * cleared and the user mappings removed before we block, and restored on
+ * failure. pins is the number of pins the caller holds on each page of the
+ * run; other pinned pages are not cleaned.
+ */
+static void
+pframe_clean_run(pframe_t **run, int npages, int pins)
+{
+        mmobj_t *o = run[0]->pf_obj;
+        int i, ret;
+
+        for (i = 0; i < npages; ++i) {
+                if (!pframe_writeback_ok(run[i], pins))
+                        break;
+        }
+        if ((npages != i) || (1 == npages) || (NULL == o->mmo_ops->cleanpages)) {
+                for (i = 0; i < npages; ++i) {
+                        if (pframe_writeback_ok(run[i], pins))
+                                pframe_clean_page(run[i]);
+                }
+                return;
+        }
+
+        dbg(DBG_PFRAME, "cleaning pages %d-%d of obj %p\n", run[0]->pf_pagenum,
+            run[npages - 1]->pf_pagenum, o);
+
+        for (i = 0; i < npages; ++i) {
+                pframe_clear_dirty(run[i]);
+                tlb_flush((uintptr_t) run[i]->pf_addr);
+                pframe_remove_from_pts(run[i]);
+                pframe_set_busy(run[i]);
+        }
+
+        ret = o->mmo_ops->cleanpages(o, run, npages);
+
+        for (i = 0; i < npages; ++i) {
+                if (ret < 0)
+                        pframe_set_dirty(run[i]);
+                pframe_clear_busy(run[i]);
+                sched_broadcast_on(&run[i]->pf_waitq);
+        }
+}
+
+/*
+ * Write out everything on the writeback batch, in (object, page number)
+ * order, one run of consecutive pages at a time, then release the batch.
+ */
+static void
+pframe_writeback_flush(void)
+{
+        pframe_t *pf;
+        mmobj_t *o;
+        int i, j;
+
+        /* insertion sort; the batch is small */
+        for (i = 1; i < nwriteback; ++i) {
+                pf = writeback_batch[i];
+                for (j = i; j > 0; --j) {
+                        pframe_t *prev = writeback_batch[j - 1];
+                        if (((uint32_t) prev->pf_obj < (uint32_t) pf->pf_obj)
+                            || ((prev->pf_obj == pf->pf_obj)
+                                && (prev->pf_pagenum < pf->pf_pagenum)))
+                                break;
+                        writeback_batch[j] = prev;
+                }
+                writeback_batch[j] = pf;
+        }
+
+        for (i = 0; i < nwriteback; i = j) {
+                o = writeback_batch[i]->pf_obj;
+                for (j = i + 1; j < nwriteback; ++j) {
+                        if ((writeback_batch[j]->pf_obj != o)
+                            || (writeback_batch[j]->pf_pagenum
+                                != writeback_batch[j - 1]->pf_pagenum + 1))
+                                break;
+                }
+                pframe_clean_run(&writeback_batch[i], j - i, 0);
+        }
+
+        /* dropping the last reference may free pages further down the
+         * batch, so clear all the flags (and wake up anyone waiting for
+         * the page to leave the batch) before putting anything */
+        for (i = 0; i < nwriteback; ++i) {
+                writeback_batch[i]->pf_flags &= ~PF_WRITEBACK;
+                sched_broadcast_on(&writeback_batch[i]->pf_waitq);
+        }
+        for (i = 0; i < nwriteback; ++i) {
+                o = writeback_batch[i]->pf_obj;
+                writeback_batch[i] = NULL;
+                o->mmo_ops->put(o);
+        }
+        nwriteback = 0;
+}
+
+/*
+ * Clean a run collected by pframe_clean_range() and let go of its pages.
+ */
+static void
+pframe_clean_pinned_run(pframe_t **run, int npages)
+{
+        int i;
+
+        pframe_clean_run(run, npages, 1);
+        for (i = 0; i < npages; ++i)
+                pframe_unpin(run[i]);
+}
+
+/*
+ * Write back the dirty pages lopage through hipage - 1 of 'o', and no
+ * others. This is msync(2)'s share of the work. Runs of consecutive dirty
+ * pages are written with pframe_clean_run(), i.e. with a single
+ * cleanpages call where the object has one. Each page is pinned as it
+ * joins a run, so that it can be neither reclaimed nor discarded while
+ * other pages of the run are being written.
+ *
+ * With 'wait' set, pages that are busy or on pageoutd's writeback batch
+ * are waited for and then written if still dirty, so that everything
+ * that was dirty in the range when we were called has been written when
+ * we return. Without it such pages are skipped, since someone is already
+ * writing them. Pages pinned by someone else are always skipped.
+ */
+void
+pframe_clean_range(struct mmobj *o, uint32_t lopage, uint32_t hipage, int wait)
+{
+        pframe_t *run[PF_WRITEBACK_BATCH];
+        pframe_t *pf;
+        uint32_t pagenum;
+        int n = 0;
+
+        /* the object must not go away while we sleep between runs */
+        o->mmo_ops->ref(o);
+
+        for (pagenum = lopage; pagenum < hipage; ++pagenum) {
+                pf = pframe_peek(o, pagenum);
+
+                if ((NULL != pf) && wait
+                    && (pframe_is_busy(pf) || (pf->pf_flags & PF_WRITEBACK))) {
+                        if (0 < n)
+                                pframe_clean_pinned_run(run, n);
+                        n = 0;
+                        /* pageoutd broadcasts when a page leaves its batch */
+                        sched_sleep_on(&pf->pf_waitq);
+                        --pagenum;      /* look at it again */
+                        continue;
+                }
+
+                if ((NULL == pf) || !pframe_writeback_ok(pf, 0)
+                    || (pf->pf_flags & PF_WRITEBACK)) {
+                        if (0 < n)
+                                pframe_clean_pinned_run(run, n);
+                        n = 0;
+                        continue;
+                }
+
+                pframe_pin(pf);
+                run[n++] = pf;
+                if (PF_WRITEBACK_BATCH == n) {
+                        pframe_clean_pinned_run(run, n);
+                        n = 0;
+                }
+        }
+        if (0 < n)
+                pframe_clean_pinned_run(run, n);
+
+        o->mmo_ops->put(o);
+}
+
+/*
+ * The pageout daemon, when run, asks the replacement policy for a victim
+ * (see pframe_next_victim). Make sure to check if the page is busy before
+ * yanking it. If the page you select is dirty, it is queued for batched
+ * writeback and reclaimed once it comes around again clean. Pages
+ * reclaimed from the recent list leave a ghost behind so that a quick
+ * re-reference promotes them. Finally, go back to sleep after having paged
+ * out the appropriate pages.
  * Both arguments unused.
  */
 static void *
 pageoutd_run(int arg1, void *arg2)
 {
         while (1) {
+                int nscanned = 0;
+
                 KASSERT(nallocated >= 0);
-                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
+                while (!pageoutd_target_met()) {
                         pframe_t *pf;
 
-                        /* obtain least-recently-requested page: */
-                        pf = list_head(&alloc_list, pframe_t, pf_link);
-
-                        if (pframe_is_busy(pf)) {
+                        if (NULL == (pf = pframe_next_victim()))
+                                break;
+                        /* twice around everything without freeing a page:
+                         * what is left can't be cleaned (e.g. anonymous
+                         * memory with no swap space left) */
+                        if (nscanned++ > (nallocated << 1) + PF_WRITEBACK_BATCH)
+                                break;
+
+                        if (pf->pf_flags & PF_WRITEBACK) {
+                                /* come all the way around to the batch */
+                                pframe_writeback_flush();
+                        } else if (pframe_is_busy(pf)) {
                                 sched_sleep_on(&pf->pf_waitq);
                         } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
+                                pframe_writeback_add(pf);
+                                if (PF_WRITEBACK_BATCH == nwriteback)
+                                        pframe_writeback_flush();
                         } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
+                                /* it's not busy, it's clean, and the policy
+                                 * picked it; reclaim it: */
+                                if (!(pf->pf_flags & PF_FREQUENT))
+                                        pframe_ghost_add(pf->pf_obj, pf->pf_pagenum);
                                 pframe_free(pf);
+                                nscanned = 0;
+
+                                /* let a stalled allocator through as soon
+                                 * as there is room for it */
+                                if (page_free_count() > nfreepages_low)
+                                        sched_wakeup_on(&alloc_waitq);
                         }
                 }
+                pframe_writeback_flush();
+
+                /*   a pass nobody had to stall for lets the boost decay */
+                if (0 == nalloc_stalls && 0 < nfreepages_boost) {
+                        nfreepages_boost >>= 1;
+                        pframe_set_watermarks();
+                }
+                nalloc_stalls = 0;
 
-                /*   release the thundering herd... */
-                sched_broadcast_on(&alloc_waitq);
+                /*   let one waiter retry even if we made no progress; it
+                 * will kick us again if memory is still short */
+                sched_wakeup_on(&alloc_waitq);
 
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
+                    "nfreepages_high=|%d| "
+                    "nfreepages_low=|%d| "
                     "nfreepages_min=|%d| "
-                    "page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
+                    "page_free_count=|%d|\n", nfreepages_high, nfreepages_low,
+                    nfreepages_min, page_free_count());
                 if (sched_cancellable_sleep_on(&pageoutd_waitq))
                         kthread_exit((void *)0);
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Waking up\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
+                    "nfreepages_high=|%d| "
+                    "nfreepages_low=|%d| "
                     "nfreepages_min=|%d| "
-                    "page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
+                    "page_free_count=|%d|\n", nfreepages_high, nfreepages_low,
+                    nfreepages_min, page_free_count());
         }
         return NULL;
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "vm/readahead.h"
+
+/*
+ * Sequential read-ahead for file pages.
+ *
+ * Readers of file pages (do_read and the page fault handler) report each
+ * access with readahead_hint(). For every object being read we remember
+ * the last page accessed; an access that starts on that page or the one
+ * after it continues a sequential stream, anything else starts a new one.
+ *
+ * While a stream stays sequential we keep requesting the pages ahead of
+ * it. The window starts at RA_MIN_WINDOW pages and doubles every time the
+ * reader catches up with the second half of what was requested, up to
+ * RA_MAX_WINDOW. The pages are started with pframe_get_async(), so they
+ * are filled by the pframe filler daemons while the reader is busy with
+ * the pages it already has. Nothing is requested while memory is short.
+ *
+ * Streams are kept in a small direct-mapped table keyed by the object
+ * pointer, which is only compared and never dereferenced, so a collision
+ * or a stale entry merely restarts a stream.
+ */
+
+#define RA_MIN_WINDOW   4
+#define RA_MAX_WINDOW   32
+#define RA_NSTREAMS     32
+
+typedef struct ra_stream {
+        mmobj_t         *ra_obj;
+        uint32_t         ra_last;       /* last page accessed */
+        uint32_t         ra_ahead;      /* first page not yet requested */
+        uint32_t         ra_window;     /* current window, 0 if not sequential yet */
+} ra_stream_t;
+
+#define hash_stream(o)  ((((uint32_t)(o)) >> 4) % RA_NSTREAMS)
+
+int readahead_pages = 0; /* for debugging/verification purposes */
+
+static ra_stream_t ra_streams[RA_NSTREAMS];
+
+/*
+ * Report that pages first through last of o have just been read. limit is
+ * the number of pages that may be read ahead to (e.g. the size of the
+ * file in pages); nothing at or beyond it is requested.
+ */
+void
+readahead_hint(mmobj_t *o, uint32_t first, uint32_t last, uint32_t limit)
+{
+        ra_stream_t *ra = &ra_streams[hash_stream(o)];
+        uint32_t end, pagenum;
+        pframe_t *pf;
+
+        KASSERT(first <= last);
+
+        if ((o != ra->ra_obj) || ((first != ra->ra_last) && (first != ra->ra_last + 1))) {
+                /* a new stream, or the old one has stopped being sequential */
+                ra->ra_obj = o;
+                ra->ra_last = last;
+                ra->ra_ahead = last + 1;
+                ra->ra_window = 0;
+                return;
+        }
+
+        ra->ra_last = last;
+        if (ra->ra_ahead < last + 1)
+                ra->ra_ahead = last + 1;
+
+        /* still more than half a window requested ahead of the reader */
+        if (ra->ra_ahead - (last + 1) > (ra->ra_window >> 1))
+                return;
+        if (pframe_memory_low())
+                return;
+
+        ra->ra_window = (0 == ra->ra_window) ? RA_MIN_WINDOW
+                        : MIN(ra->ra_window << 1, RA_MAX_WINDOW);
+        end = MIN(last + 1 + ra->ra_window, limit);
+
+        for (pagenum = ra->ra_ahead; pagenum < end; ++pagenum) {
+                if (NULL != pframe_peek(o, pagenum))
+                        continue;
+                if (0 > pframe_get_async(o, pagenum, NULL, &pf))
+                        break;
+                readahead_pages++;
+        }
+        if (ra->ra_ahead < end)
+                ra->ra_ahead = end;
+}
+
+/*
+ * Like readahead_hint(), for a reader that has declared that it reads
+ * sequentially (MADV_SEQUENTIAL): the access always continues the
+ * object's stream, and the window starts out at its largest.
+ */
+void
+readahead_sequential(mmobj_t *o, uint32_t first, uint32_t last, uint32_t limit)
+{
+        ra_stream_t *ra = &ra_streams[hash_stream(o)];
+
+        if ((o != ra->ra_obj) || ((first != ra->ra_last) && (first != ra->ra_last + 1))) {
+                ra->ra_obj = o;
+                ra->ra_ahead = first;
+        }
+        ra->ra_last = first;
+        /* doubled to RA_MAX_WINDOW by readahead_hint() */
+        ra->ra_window = RA_MAX_WINDOW >> 1;
+
+        readahead_hint(o, first, last, limit);
+}
@@ -4,6 +4,8 @@
 #include "util/string.h"
 #include "util/debug.h"
 
+#include "proc/sched.h"
+
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 #include "mm/mm.h"
@@ -14,14 +16,18 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
+#include "vm/swap.h"
+#include "vm/anon.h"
 
 #define SHADOW_SINGLETON_THRESHOLD 5
 
 int shadow_count = 0; /* for debugging/verification purposes */
+int shadow_steals = 0; /* pages moved rather than copied on write */
 #ifdef __SHADOWD__
 /*
  * number of shadow objects with a single parent, that is another shadow
- * object in the shadow objects tree(singletons)
+ * object in the shadow objects tree(singletons), seen since shadowd was
+ * last alerted
  */
 static int shadow_singleton_count = 0;
 #endif
@@ -34,6 +40,7 @@ static int  shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe
 static int  shadow_fillpage(mmobj_t *o, pframe_t *pf);
 static int  shadow_dirtypage(mmobj_t *o, pframe_t *pf);
 static int  shadow_cleanpage(mmobj_t *o, pframe_t *pf);
+static int  shadow_cleanpages(mmobj_t *o, pframe_t **pfs, int npages);
 
 static mmobj_ops_t shadow_mmobj_ops = {
         .ref = shadow_ref,
@@ -41,7 +48,8 @@ static mmobj_ops_t shadow_mmobj_ops = {
         .lookuppage = shadow_lookuppage,
         .fillpage  = shadow_fillpage,
         .dirtypage = shadow_dirtypage,
-        .cleanpage = shadow_cleanpage
+        .cleanpage = shadow_cleanpage,
+        .cleanpages = shadow_cleanpages
 };
 
 /*
@@ -75,11 +83,81 @@ shadow_create()
         mmobj_t* shad_obj = (mmobj_t*)slab_obj_alloc(shadow_allocator);
         mmobj_init(shad_obj,&shadow_mmobj_ops);
         shad_obj->mmo_refcount = 1;
+        shad_obj->mmo_lopage = shad_obj->mmo_hipage = 0;
         dbg(DBG_PRINT, "(GRADING3A)\n");
         return shad_obj;
 
 }
 
+/*
+ * Whether o is a shadow object.
+ */
+int
+shadow_is_shadow(mmobj_t *o)
+{
+        return &shadow_mmobj_ops == o->mmo_ops;
+}
+
+/*
+ * Returns true if no object in the shadow chain starting at o has any data
+ * for the given page and the chain ends in an anonymous object, so that the
+ * page still reads as all zeros. o may also be the bottom object itself.
+ */
+int
+shadow_untouched(mmobj_t *o, uint32_t pagenum)
+{
+        while (&shadow_mmobj_ops == o->mmo_ops) {
+                if ((NULL != pframe_peek(o, pagenum)) || swap_has(o, pagenum))
+                        return 0;
+                o = o->mmo_shadowed;
+        }
+        return anon_untouched(o, pagenum);
+}
+
+/*
+ * Like shadow_untouched, but for the npages pages starting at pagenum, and
+ * without looking at them one by one: each object in the chain is only
+ * asked whether the range misses every page it has ever held (see
+ * pframe_alloc()), so a range that merely lies between two touched pages is
+ * treated as touched.
+ */
+int
+shadow_range_untouched(mmobj_t *o, uint32_t pagenum, uint32_t npages)
+{
+        while (1) {
+                if ((o->mmo_lopage < o->mmo_hipage)
+                    && (pagenum < o->mmo_hipage) && (o->mmo_lopage < pagenum + npages))
+                        return 0;
+                if (&shadow_mmobj_ops != o->mmo_ops)
+                        return anon_is_anon(o);
+                o = o->mmo_shadowed;
+        }
+}
+
+/*
+ * Returns the page a read of pagenum through the shadow chain starting at
+ * o would find, if that page is resident and not busy, and NULL otherwise.
+ * Unlike a lookup this never blocks and never brings anything in, so it is
+ * safe to call for pages nobody has asked for yet (e.g. fault-around).
+ * o may also be the bottom object itself.
+ */
+pframe_t *
+shadow_resident(mmobj_t *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+
+        while (&shadow_mmobj_ops == o->mmo_ops) {
+                if (NULL != (pf = pframe_peek(o, pagenum)))
+                        return pframe_is_busy(pf) ? NULL : pf;
+                if (swap_has(o, pagenum))
+                        return NULL;
+                o = o->mmo_shadowed;
+        }
+
+        pf = pframe_peek(o, pagenum);
+        return ((NULL == pf) || pframe_is_busy(pf)) ? NULL : pf;
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -114,19 +192,28 @@ shadow_put(mmobj_t *o)
 
         if(o->mmo_refcount != o->mmo_nrespages+1){
                 o->mmo_refcount--;
+#ifdef __SHADOWD__
+                if(o->mmo_refcount == o->mmo_nrespages+1){
+                        /* one referrer left, shadowd can fold this object
+                         * into it */
+                        if(++shadow_singleton_count > SHADOW_SINGLETON_THRESHOLD){
+                                shadow_singleton_count = 0;
+                                shadowd_alert();
+                        }
+                }
+#endif
                 dbg(DBG_PRINT, "(GRADING3A 6)\n");
         }else{
                 pframe_t *pframe_iter;
 
                 list_iterate_begin(&o->mmo_respages,pframe_iter,pframe_t,pf_olink) {
 
-                        pframe_unpin(pframe_iter);
-                        pframe_clean(pframe_iter);
                         pframe_free(pframe_iter);
 
                         dbg(DBG_PRINT, "(GRADING3A 6)\n");
 
                 } list_iterate_end();
+                swap_release(o);
 
                 o->mmo_shadowed->mmo_ops->put(o->mmo_shadowed);
                 slab_obj_free(shadow_allocator, o);
@@ -139,6 +226,41 @@ shadow_put(mmobj_t *o)
 
 }
 
+/*
+ * Copy-on-write without the copy. o is about to get its own copy of the
+ * page for writing. Every shadow object below o that is referred to by
+ * nothing but the object above it can only be seen through o, so if the
+ * page is found resident in one of them before reaching an object that
+ * is shared (or the bottom object), nobody else can ever read that page:
+ * it is moved into o with pframe_migrate() instead of being copied.
+ *
+ * @return the page, now belonging to o, or NULL if it has to be copied
+ */
+static pframe_t *
+shadow_steal(mmobj_t *o, uint32_t pagenum)
+{
+        mmobj_t *s = o->mmo_shadowed;
+        pframe_t *pf;
+
+        if (swap_has(o, pagenum))
+                return NULL;
+
+        while ((&shadow_mmobj_ops == s->mmo_ops)
+               && (1 == s->mmo_refcount - s->mmo_nrespages)) {
+                if (NULL != (pf = pframe_peek(s, pagenum))) {
+                        if (pframe_is_busy(pf))
+                                return NULL;
+                        pframe_migrate(pf, o);
+                        shadow_steals++;
+                        return pf;
+                }
+                if (swap_has(s, pagenum))
+                        return NULL;
+                s = s->mmo_shadowed;
+        }
+        return NULL;
+}
+
 /* This function looks up the given page in this shadow object. The
  * forwrite argument is true if the page is being looked up for
  * writing, false if it is being looked up for reading. This function
@@ -147,23 +269,36 @@ shadow_put(mmobj_t *o)
  * given page resident). copy-on-write magic (necessary when forwrite
  * is true) is handled in shadow_fillpage, not here. It is important to
  * use iteration rather than recursion here as a recursive implementation
- * can overflow the kernel stack when looking down a long shadow chain */
+ * can overflow the kernel stack when looking down a long shadow chain.
+ * A resident page may be busy (being filled, cleaned or reclaimed); we
+ * wait for it and start over, since the chain may have changed meanwhile */
 static int
 shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
         //NOT_YET_IMPLEMENTED("VM: shadow_lookuppage");
         //return 0;
 
-        mmobj_t* shad_next = o;
+        mmobj_t* shad_next;
         pframe_t* pf_temp = NULL;
 
+again:
+        shad_next = o;
         if(forwrite != 1){
                 if(shad_next->mmo_shadowed != NULL){
 
                         do{
                                 pf_temp = pframe_get_resident(shad_next, pagenum);
+                                if(pf_temp != NULL && pframe_is_busy(pf_temp)){
+                                        sched_sleep_on(&pf_temp->pf_waitq);
+                                        dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                                        goto again;
+                                }
 
-                                if(pf_temp == NULL){
+                                if(pf_temp == NULL && swap_has(shad_next, pagenum)){
+                                        /* this object's copy is in swap, bring it back in */
+                                        dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                                        return pframe_get(shad_next, pagenum, pf);
+                                }else if(pf_temp == NULL){
                                         shad_next = shad_next->mmo_shadowed;
                                         dbg(DBG_PRINT, "(GRADING3A 6)\n");
                                 }else{
@@ -192,6 +327,18 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
         }else{
 
                 pf_temp = pframe_get_resident(o,pagenum);
+                if(pf_temp != NULL && pframe_is_busy(pf_temp)){
+                        sched_sleep_on(&pf_temp->pf_waitq);
+                        dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                        goto again;
+                }
+
+                if(!pf_temp && NULL != (pf_temp = shadow_steal(o,pagenum))){
+                        *pf = pf_temp;
+                        shadow_dirtypage(o,*pf);
+                        dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                        return 0;
+                }
 
                 if(!pf_temp){
 
@@ -226,7 +373,8 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
  * for the pf->pf_pagenum-th page from the last object in the chain).
  * It is important to use iteration rather than recursion here as a
  * recursive implementation can overflow the kernel stack when
- * looking down a long shadow chain */
+ * looking down a long shadow chain. As in shadow_lookuppage, a busy
+ * page found on the way is waited for and the walk started over */
 static int
 shadow_fillpage(mmobj_t *o, pframe_t *pf)
 {
@@ -238,21 +386,41 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
         KASSERT(!pframe_is_pinned(pf));
         dbg(DBG_PRINT, "(GRADING3A 6.e)\n");
 
-        mmobj_t* shad_next = o;
+        mmobj_t* shad_next;
         pframe_t* pf_temp = NULL;
 
+        /* our own copy may have been swapped out */
+        int retVal = swap_in(o, pf);
+        if (retVal != 0) {
+                dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                return (retVal < 0) ? retVal : 0;
+        }
+
+again:
+        shad_next = o;
         if (shad_next->mmo_shadowed != NULL) {
 
                 do {
 
                         pf_temp = pframe_get_resident(shad_next->mmo_shadowed, pf->pf_pagenum);
+                        if (pf_temp && pframe_is_busy(pf_temp)) {
+                                sched_sleep_on(&pf_temp->pf_waitq);
+                                dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                                goto again;
+                        }
+                        if (!pf_temp && swap_has(shad_next->mmo_shadowed, pf->pf_pagenum)) {
+                                retVal = pframe_get(shad_next->mmo_shadowed, pf->pf_pagenum, &pf_temp);
+                                if (retVal != 0) {
+                                        dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                                        return retVal;
+                                }
+                        }
                         if (!pf_temp) {
                                 shad_next = shad_next->mmo_shadowed;
                                 dbg(DBG_PRINT, "(GRADING3A 6)\n");
                         }
 
                         else {
-                                pframe_pin(pf);
                                 memcpy(pf->pf_addr, pf_temp->pf_addr, PAGE_SIZE);
                                 dbg(DBG_PRINT, "(GRADING3A 6)\n");
                                 return 0;
@@ -264,14 +432,22 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
 
         }
 
-        int retVal = pframe_lookup(o->mmo_un.mmo_bottom_obj, pf->pf_pagenum, 0, &pf_temp);
+        if (anon_untouched(o->mmo_un.mmo_bottom_obj, pf->pf_pagenum)) {
+                /* nobody has written this page yet: zero-fill our copy
+                 * instead of materializing the bottom page just to copy it */
+                pframe_zero(pf);
+                anon_zero_maps++;
+                dbg(DBG_PRINT, "(GRADING3A 6)\n");
+                return 0;
+        }
+
+        retVal = pframe_lookup(o->mmo_un.mmo_bottom_obj, pf->pf_pagenum, 0, &pf_temp);
 
         if (retVal != 0) {
                 dbg(DBG_PRINT, "(GRADING3A 6)\n");
                 return retVal;
         }
 
-        pframe_pin(pf);
         memcpy(pf->pf_addr, pf_temp->pf_addr, PAGE_SIZE);
         dbg(DBG_PRINT, "(GRADING3A 6)\n");
         return 0;
@@ -286,6 +462,7 @@ shadow_dirtypage(mmobj_t *o, pframe_t *pf)
         //NOT_YET_IMPLEMENTED("VM: shadow_dirtypage");
         //return -1;
 
+        swap_forget(o, pf->pf_pagenum);
         pframe_set_dirty(pf);
         dbg(DBG_PRINT, "(GRADING3A)\n");
         return 0;
@@ -298,12 +475,14 @@ shadow_cleanpage(mmobj_t *o, pframe_t *pf)
         //NOT_YET_IMPLEMENTED("VM: shadow_cleanpage");
         //return -1;
 
-        pframe_t* pf_temp;
-
-        o->mmo_ops->lookuppage(o, pf->pf_pagenum, 1, &pf_temp);
-        memcpy(pf_temp->pf_addr, pf->pf_addr, PAGE_SIZE);
-        pframe_clear_dirty(pf_temp);
         dbg(DBG_PRINT, "(GRADING3A)\n");
-        return 0;
+        return swap_out(o, &pf, 1);
 
+}
+
+/* Write a run of consecutive dirty pages out to swap at once. */
+static int
+shadow_cleanpages(mmobj_t *o, pframe_t **pfs, int npages)
+{
+        return swap_out(o, pfs, npages);
 }
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+
+#include "vm/vmmap.h"
+#include "vm/shadow.h"
+#include "vm/shadowd.h"
+#include "vm/swap.h"
+
+/*
+ * The shadow daemon.
+ *
+ * Every fork pushes a new shadow object onto each private area of both
+ * processes, and lookups walk the chain down to the first object that has
+ * the page. When one of the two processes exits or unmaps the area, the
+ * shadow object the fork shadowed is left with a single referrer: the
+ * shadow object directly above it. Such an object no longer serves any
+ * purpose, since nothing else can see its pages, but it still costs every
+ * lookup that goes past it.
+ *
+ * shadowd walks the private areas of every process and folds each such
+ * object into the object above it: its pages are migrated up with
+ * pframe_migrate() (pages the object above already has a newer copy of are
+ * simply dropped), and the object above is made to shadow whatever the
+ * folded object shadowed. Chains therefore only ever hold objects that are
+ * shared by more than one referrer, so their length stays bounded by the
+ * depth of the fork tree of the processes that are still alive.
+ *
+ * shadow_put() alerts shadowd once enough objects have been left with a
+ * single referrer.
+ */
+
+/* Number of times a pass may start over after blocking before shadowd
+ * goes back to sleep until the next alert. */
+#define SHADOWD_MAX_RESTARTS 64
+
+int shadowd_collapsed = 0; /* for debugging/verification purposes */
+
+static proc_t *shadowd = NULL;
+static kthread_t *shadowd_thr = NULL;
+static ktqueue_t shadowd_waitq;
+static int shadowd_alerted = 0;
+
+static void *shadowd_run(int arg1, void *arg2);
+
+static __attribute__((unused)) void
+shadowd_init(void)
+{
+        sched_queue_init(&shadowd_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        shadowd = proc_create("shadowd");
+        KASSERT(NULL != shadowd);
+        shadowd_thr = kthread_create(shadowd, shadowd_run, 0, NULL);
+        KASSERT(NULL != shadowd_thr);
+
+        sched_make_runnable(shadowd_thr);
+}
+init_func(shadowd_init);
+init_depends(sched_init);
+
+/*
+ * Stop shadowd and wait for it. Called from idleproc.
+ */
+void
+shadowd_shutdown(void)
+{
+        int pid, child;
+
+        KASSERT(NULL != shadowd_thr);
+        kthread_cancel(shadowd_thr, (void *) 0);
+        shadowd_thr = NULL;
+
+        pid = shadowd->p_pid;
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child && "waited on process other than shadowd");
+}
+
+/*
+ * Ask shadowd to make a pass over all shadow chains.
+ */
+void
+shadowd_alert(void)
+{
+        shadowd_alerted = 1;
+        sched_wakeup_on(&shadowd_waitq);
+}
+
+/* The only referrer of a shadow object in this state is the shadow object
+ * above it, each resident page holding one more reference. */
+#define shadowd_singleton(s) \
+        (shadow_is_shadow(s) && (1 == (s)->mmo_refcount - (s)->mmo_nrespages))
+
+/*
+ * Returns some busy resident page of the object, or NULL if none is busy.
+ */
+static pframe_t *
+shadowd_busy_page(mmobj_t *s)
+{
+        pframe_t *pf;
+
+        list_iterate_begin(&s->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pframe_is_busy(pf))
+                        return pf;
+        } list_iterate_end();
+        return NULL;
+}
+
+/*
+ * Fold the object c shadows into c, if c is its only referrer.
+ *
+ * Everything that may block (bringing the object's pages back from swap,
+ * waiting for busy pages) is done first, and the object is checked again
+ * after every wait. The migration itself does not block, so nothing can
+ * look at the object half way through.
+ *
+ * @return 1 if the object was folded, 0 if it could not be, and -1 if we
+ * blocked on the way (whether or not the object was folded), in which case
+ * any vmarea or chain the caller was walking may have changed
+ */
+static int
+shadowd_collapse(mmobj_t *c)
+{
+        mmobj_t *s = c->mmo_shadowed;
+        pframe_t *pf;
+        uint32_t pagenum;
+        int blocked = 0;
+
+        if (!shadowd_singleton(s))
+                return 0;
+
+        /* keep c around while we block */
+        c->mmo_ops->ref(c);
+
+        while (shadowd_singleton(s)) {
+                if (swap_first(s, &pagenum)) {
+                        if ((NULL != pframe_peek(c, pagenum)) || swap_has(c, pagenum)) {
+                                /* c has a newer copy */
+                                swap_forget(s, pagenum);
+                        } else {
+                                blocked = 1;
+                                if (0 > pframe_get(s, pagenum, &pf))
+                                        break;
+                                /* swap_in() keeps the slot, so drop it or
+                                 * swap_first() hands us this page again;
+                                 * the page is about to move up anyway, so
+                                 * mark it dirty in case it is reclaimed
+                                 * before then */
+                                pframe_set_dirty(pf);
+                                swap_forget(s, pagenum);
+                        }
+                        continue;
+                }
+
+                if (NULL != (pf = shadowd_busy_page(s))) {
+                        blocked = 1;
+                        sched_sleep_on(&pf->pf_waitq);
+                        continue;
+                }
+
+                /* nothing left that can block */
+                list_iterate_begin(&s->mmo_respages, pf, pframe_t, pf_olink) {
+                        pframe_migrate(pf, c);
+                } list_iterate_end();
+                KASSERT(0 == s->mmo_nrespages && 1 == s->mmo_refcount);
+
+                dbg(DBG_VM, "shadowd: folding %p into %p\n", s, c);
+                c->mmo_shadowed = s->mmo_shadowed;
+                c->mmo_shadowed->mmo_ops->ref(c->mmo_shadowed);
+                s->mmo_ops->put(s);
+                shadowd_collapsed++;
+
+                c->mmo_ops->put(c);
+                return blocked ? -1 : 1;
+        }
+
+        c->mmo_ops->put(c);
+        return blocked ? -1 : 0;
+}
+
+/*
+ * Walk the shadow chains of every private area of every process and fold
+ * every object that only has a single referrer. Whenever we block the
+ * process and vmarea lists may have changed under us, so the walk starts
+ * over.
+ */
+static void
+shadowd_pass(void)
+{
+        int restarts = 0;
+        proc_t *p;
+        vmarea_t *vma;
+        mmobj_t *c;
+
+again:
+        if (restarts++ > SHADOWD_MAX_RESTARTS)
+                return;
+
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if ((PROC_DEAD == p->p_state) || (NULL == p->p_vmmap))
+                        continue;
+                list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                        for (c = vma->vma_obj; shadow_is_shadow(c); c = c->mmo_shadowed) {
+                                int ret;
+                                while (0 != (ret = shadowd_collapse(c))) {
+                                        if (0 > ret)
+                                                goto again;
+                                }
+                        }
+                } list_iterate_end();
+        } list_iterate_end();
+}
+
+/*
+ * shadowd sleeps until it is alerted, then makes a pass over all shadow
+ * chains.
+ * Both arguments unused.
+ */
+static void *
+shadowd_run(int arg1, void *arg2)
+{
+        while (1) {
+                while (shadowd_alerted) {
+                        shadowd_alerted = 0;
+                        shadowd_pass();
+                }
+
+                dbg(DBG_VM, "shadowd: %d objects folded so far\n", shadowd_collapsed);
+                if (sched_cancellable_sleep_on(&shadowd_waitq))
+                        kthread_exit((void *) 0);
+        }
+        return NULL;
+}
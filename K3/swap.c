@@ -0,0 +1,422 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/init.h"
+
+#include "drivers/dev.h"
+#include "drivers/blockdev.h"
+#include "drivers/disk/ata.h"
+
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/pframe.h"
+
+#include "vm/swap.h"
+#include "vm/zswap.h"
+
+/*
+ * Swap space for anonymous memory.
+ *
+ * Anonymous and shadow objects have no backing store of their own, so
+ * without swap their dirty pages could never be reclaimed. Here we give
+ * them one: the second disk is used as a swap area of SWAP_NSLOTS page
+ * sized slots. When pageoutd cleans an anonymous page it is written to a
+ * free slot (swap_out) and the (object, page number) -> slot mapping is
+ * remembered, so that the object's fillpage can read it back (swap_in) the
+ * next time the page is faulted in.
+ *
+ * A slot stays allocated after its page has been read back in, so a page
+ * that is evicted again without having been written to is reclaimed without
+ * any I/O. As soon as the page is dirtied the copy on disk is stale and the
+ * object must drop it with swap_forget. When the object goes away, all its
+ * slots are released with swap_release.
+ *
+ * Pages that compress well never reach the disk: swap_out first offers
+ * every page to the compressed in-memory tier (zswap.c) and only writes the
+ * runs of pages it refuses. A page read back from that tier is dirty, as
+ * its compressed copy is gone.
+ *
+ * If the swap disk does not exist, whatever zswap refuses cannot be
+ * swapped out: swap_out fails with -ENOSPC and those pages simply stay
+ * dirty (and hence resident).
+ */
+
+#define SWAP_DEVID      MKDEVID(DISK_MAJOR, 1)
+#define SWAP_NSLOTS     4096            /* 16MB of swap */
+#define SWAP_HASH_SIZE  256
+#define SWAP_MAX_RUN    32              /* largest run written at once */
+
+typedef struct swap_entry {
+        mmobj_t         *se_obj;
+        uint32_t         se_pagenum;
+        uint32_t         se_slot;
+        list_link_t      se_hlink;      /* on a swap_hash chain */
+        list_link_t      se_olink;      /* on a swap_obj_hash chain */
+} swap_entry_t;
+
+#define hash_swap(o, pagenum)   ((((uint32_t)(o)) + (pagenum)) % SWAP_HASH_SIZE)
+#define hash_swap_obj(o)        ((((uint32_t)(o)) >> 4) % SWAP_HASH_SIZE)
+
+int swap_slots_used = 0; /* for debugging/verification purposes */
+
+static blockdev_t *swap_bd = NULL;
+static int swap_probed = 0;
+
+static uint32_t swap_bitmap[SWAP_NSLOTS / 32];
+static uint32_t swap_hint = 0;
+
+static list_t swap_hash[SWAP_HASH_SIZE];
+static list_t swap_obj_hash[SWAP_HASH_SIZE];
+
+static slab_allocator_t *swap_entry_allocator;
+
+/* Bounce buffer for writing a run with one request, reserved at boot since
+ * it is needed exactly when memory is short. Only one run can use it at a
+ * time; other writers fall back to writing a page at a time. */
+static char *swap_bounce;
+static int swap_bounce_busy = 0;
+
+static void
+swap_init(void)
+{
+        int i;
+
+        swap_entry_allocator = slab_allocator_create("swap_entry",
+                                                     sizeof(swap_entry_t));
+        KASSERT(NULL != swap_entry_allocator);
+
+        for (i = 0; i < SWAP_HASH_SIZE; ++i) {
+                list_init(&swap_hash[i]);
+                list_init(&swap_obj_hash[i]);
+        }
+
+        swap_bounce = page_alloc_n(SWAP_MAX_RUN);
+        KASSERT(NULL != swap_bounce);
+}
+init_func(swap_init);
+
+/*
+ * The disks are registered by their driver during boot, possibly after we
+ * are initialized, so the swap device is looked up on first use.
+ */
+static blockdev_t *
+swap_device(void)
+{
+        if (!swap_probed) {
+                swap_probed = 1;
+                swap_bd = blockdev_lookup(SWAP_DEVID);
+                dbg(DBG_PFRAME, "swap: %s\n", (NULL == swap_bd)
+                    ? "no swap disk, anonymous memory is unevictable"
+                    : "using disk 1 for swap");
+        }
+        return swap_bd;
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------- SLOT ALLOCATOR ------------------------- */
+/* ------------------------------------------------------------------ */
+
+#define slot_is_used(slot) (swap_bitmap[(slot) >> 5] & (1U << ((slot) & 31)))
+
+/*
+ * Find npages consecutive free slots, starting the search where the last
+ * one left off (next fit) so that successive writebacks tend to land next
+ * to each other on disk.
+ *
+ * @return the first slot of the run, or -1 if there is no such run
+ */
+static int
+swap_slot_alloc(int npages)
+{
+        uint32_t slot, start, run;
+        uint32_t scanned;
+
+        KASSERT(0 < npages && npages <= SWAP_NSLOTS);
+
+        start = slot = swap_hint;
+        run = 0;
+        for (scanned = 0; scanned < SWAP_NSLOTS + (uint32_t) npages; ++scanned) {
+                if (SWAP_NSLOTS == slot) {
+                        /* runs don't wrap around the end of the disk */
+                        slot = 0;
+                        run = 0;
+                }
+                if (slot_is_used(slot)) {
+                        run = 0;
+                } else {
+                        if (0 == run)
+                                start = slot;
+                        if ((uint32_t) npages == ++run) {
+                                for (slot = start; slot < start + npages; ++slot)
+                                        swap_bitmap[slot >> 5] |= 1U << (slot & 31);
+                                swap_hint = start + npages;
+                                swap_slots_used += npages;
+                                return start;
+                        }
+                }
+                slot++;
+        }
+
+        return -1;
+}
+
+static void
+swap_slot_free(uint32_t slot)
+{
+        KASSERT(slot < SWAP_NSLOTS && slot_is_used(slot));
+
+        swap_bitmap[slot >> 5] &= ~(1U << (slot & 31));
+        swap_slots_used--;
+}
+
+/* ------------------------------------------------------------------ */
+/* ---------------------------- SLOT MAP ---------------------------- */
+/* ------------------------------------------------------------------ */
+
+static swap_entry_t *
+swap_lookup(mmobj_t *o, uint32_t pagenum)
+{
+        swap_entry_t *se;
+
+        list_iterate_begin(&swap_hash[hash_swap(o, pagenum)], se,
+                           swap_entry_t, se_hlink) {
+                if ((o == se->se_obj) && (pagenum == se->se_pagenum))
+                        return se;
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static void
+swap_entry_free(swap_entry_t *se)
+{
+        swap_slot_free(se->se_slot);
+        list_remove(&se->se_hlink);
+        list_remove(&se->se_olink);
+        slab_obj_free(swap_entry_allocator, se);
+}
+
+/*
+ * Returns true if the given page of the object has a copy in swap.
+ */
+int
+swap_has(mmobj_t *o, uint32_t pagenum)
+{
+        return zswap_has(o, pagenum) || (NULL != swap_lookup(o, pagenum));
+}
+
+/*
+ * Drop the swap copy of the given page, if there is one. This must be
+ * called whenever the resident page is dirtied.
+ */
+void
+swap_forget(mmobj_t *o, uint32_t pagenum)
+{
+        swap_entry_t *se;
+
+        zswap_forget(o, pagenum);
+        if (NULL != (se = swap_lookup(o, pagenum)))
+                swap_entry_free(se);
+}
+
+/*
+ * Find some page of the object which has a copy in swap.
+ *
+ * @return 1 and the page number in *pagenum if there is one, 0 otherwise
+ */
+int
+swap_first(mmobj_t *o, uint32_t *pagenum)
+{
+        swap_entry_t *se;
+
+        if (zswap_first(o, pagenum))
+                return 1;
+        list_iterate_begin(&swap_obj_hash[hash_swap_obj(o)], se,
+                           swap_entry_t, se_olink) {
+                if (o == se->se_obj) {
+                        *pagenum = se->se_pagenum;
+                        return 1;
+                }
+        } list_iterate_end();
+        return 0;
+}
+
+/*
+ * Release all the swap slots of an object which is being destroyed.
+ */
+void
+swap_release(mmobj_t *o)
+{
+        swap_entry_t *se;
+
+        zswap_release(o);
+        list_iterate_begin(&swap_obj_hash[hash_swap_obj(o)], se,
+                           swap_entry_t, se_olink) {
+                if (o == se->se_obj)
+                        swap_entry_free(se);
+        } list_iterate_end();
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------------- I/O ------------------------------ */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Write a run of consecutive pages of an object to the swap disk. If
+ * npages consecutive slots can be found and the bounce buffer is free, the
+ * whole run goes to disk with a single write; otherwise it is written a
+ * page at a time, straight from the frames.
+ */
+static int
+swap_write(mmobj_t *o, pframe_t **pfs, int npages)
+{
+        blockdev_t *bd;
+        swap_entry_t *se[SWAP_MAX_RUN];
+        char *buf = NULL;
+        int slot, ret, i;
+
+        if (NULL == (bd = swap_device()))
+                return -ENOSPC;
+
+        if (1 < npages) {
+                if ((0 > (slot = swap_slot_alloc(npages))) || swap_bounce_busy) {
+                        if (0 <= slot) {
+                                for (i = 0; i < npages; ++i)
+                                        swap_slot_free(slot + i);
+                        }
+                        for (i = 0; i < npages; ++i) {
+                                if (0 > (ret = swap_write(o, &pfs[i], 1)))
+                                        return ret;
+                        }
+                        return 0;
+                }
+                buf = swap_bounce;
+                swap_bounce_busy = 1;
+        } else if (0 > (slot = swap_slot_alloc(1))) {
+                return -ENOSPC;
+        }
+
+        for (i = 0; i < npages; ++i) {
+                if (NULL == (se[i] = slab_obj_alloc(swap_entry_allocator))) {
+                        while (i-- > 0)
+                                slab_obj_free(swap_entry_allocator, se[i]);
+                        ret = -ENOMEM;
+                        goto fail;
+                }
+        }
+
+        if (1 < npages) {
+                for (i = 0; i < npages; ++i)
+                        memcpy(buf + i * PAGE_SIZE, pfs[i]->pf_addr, PAGE_SIZE);
+                ret = bd->bd_ops->write_block(bd, buf, slot, npages);
+        } else {
+                ret = bd->bd_ops->write_block(bd, pfs[0]->pf_addr, slot, 1);
+        }
+        if (0 > ret) {
+                for (i = 0; i < npages; ++i)
+                        slab_obj_free(swap_entry_allocator, se[i]);
+                goto fail;
+        }
+
+        dbg(DBG_PFRAME, "swapped out pages %d-%d of obj %p to slot %d\n",
+            pfs[0]->pf_pagenum, pfs[npages - 1]->pf_pagenum, o, slot);
+
+        for (i = 0; i < npages; ++i) {
+                se[i]->se_obj = o;
+                se[i]->se_pagenum = pfs[i]->pf_pagenum;
+                se[i]->se_slot = slot + i;
+                list_insert_head(&swap_hash[hash_swap(o, se[i]->se_pagenum)],
+                                 &se[i]->se_hlink);
+                list_insert_head(&swap_obj_hash[hash_swap_obj(o)],
+                                 &se[i]->se_olink);
+        }
+        ret = 0;
+
+fail:
+        if (NULL != buf)
+                swap_bounce_busy = 0;
+        if (0 > ret) {
+                for (i = 0; i < npages; ++i)
+                        swap_slot_free(slot + i);
+        }
+        return ret;
+}
+
+/*
+ * Write a run of consecutive pages of an object out to swap. The pages are
+ * given in page number order and are busy. Pages that compress well are
+ * kept in memory by zswap; the runs of pages that don't go to disk.
+ *
+ * @param o the object the pages belong to
+ * @param pfs the pages
+ * @param npages the number of pages
+ * @return 0 on success, -errno on failure
+ */
+int
+swap_out(mmobj_t *o, pframe_t **pfs, int npages)
+{
+        char compressed[SWAP_MAX_RUN];
+        int ret, i, j;
+
+        if (SWAP_MAX_RUN < npages) {
+                if (0 > (ret = swap_out(o, pfs, SWAP_MAX_RUN)))
+                        return ret;
+                return swap_out(o, pfs + SWAP_MAX_RUN, npages - SWAP_MAX_RUN);
+        }
+
+        for (i = 0; i < npages; ++i) {
+                KASSERT(o == pfs[i]->pf_obj && pframe_is_busy(pfs[i]));
+                swap_forget(o, pfs[i]->pf_pagenum);
+                compressed[i] = (0 == zswap_store(o, pfs[i]->pf_pagenum,
+                                                  pfs[i]->pf_addr));
+        }
+
+        for (i = 0; i < npages; i = j) {
+                if (compressed[i]) {
+                        j = i + 1;
+                        continue;
+                }
+                for (j = i + 1; (j < npages) && !compressed[j]; ++j)
+                        ;
+                if (0 > (ret = swap_write(o, &pfs[i], j - i)))
+                        return ret;
+        }
+
+        return 0;
+}
+
+/*
+ * Fill a page from swap if the object has a copy of it there.
+ *
+ * @param o the object the page belongs to
+ * @param pf the (busy) page to fill
+ * @return 1 if the page was read from swap, 0 if it has never been swapped
+ * out, -errno on failure
+ */
+int
+swap_in(mmobj_t *o, pframe_t *pf)
+{
+        swap_entry_t *se;
+        int ret;
+
+        if (0 != (ret = zswap_load(o, pf))) {
+                if (0 < ret)
+                        pframe_set_dirty(pf);
+                return ret;
+        }
+
+        if (NULL == (se = swap_lookup(o, pf->pf_pagenum)))
+                return 0;
+
+        KASSERT(NULL != swap_bd);
+        if (0 > (ret = swap_bd->bd_ops->read_block(swap_bd, pf->pf_addr,
+                                                   se->se_slot, 1)))
+                return ret;
+
+        dbg(DBG_PFRAME, "swapped in page %d of obj %p from slot %d\n",
+            pf->pf_pagenum, o, se->se_slot);
+        return 1;
+}
@@ -530,6 +530,80 @@ static int sys_munmap(munmap_args_t *args)
         return 0;
 }
 
+static int sys_mprotect(mprotect_args_t *args)
+{
+        mprotect_args_t         kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mprotect_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_mprotect(kargs.addr, kargs.len, kargs.prot);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_madvise(madvise_args_t *args)
+{
+        madvise_args_t          kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static void *sys_mremap(mremap_args_t *arg)
+{
+        mremap_args_t           kargs;
+        void                    *ret;
+        int                     err;
+
+        if (copy_from_user(&kargs, arg, sizeof(mremap_args_t)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return MAP_FAILED;
+        }
+
+        err = do_mremap(kargs.mra_addr, kargs.mra_old_len, kargs.mra_new_len,
+                        kargs.mra_flags, &ret);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return MAP_FAILED;
+        }
+        return ret;
+}
+
+static int sys_msync(msync_args_t *args)
+{
+        msync_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(msync_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_msync(kargs.addr, kargs.len, kargs.flags);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
         mmap_args_t             kargs;
@@ -867,6 +941,18 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_munmap:
                         return sys_munmap((munmap_args_t *) args);
 
+                case SYS_mprotect:
+                        return sys_mprotect((mprotect_args_t *) args);
+
+                case SYS_madvise:
+                        return sys_madvise((madvise_args_t *) args);
+
+                case SYS_mremap:
+                        return (int) sys_mremap((mremap_args_t *) args);
+
+                case SYS_msync:
+                        return sys_msync((msync_args_t *) args);
+
                 case SYS_open:
                         return sys_open((open_args_t *) args);
 
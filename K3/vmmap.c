@@ -5,6 +5,7 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/swap.h"
 
 #include "proc/proc.h"
 
@@ -25,6 +26,7 @@
 #include "mm/mmobj.h"
 
 #include "mm/tlb.h"
+#include "mm/pframe.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
@@ -44,6 +46,8 @@ vmarea_alloc(void)
         vmarea_t *newvma = (vmarea_t *) slab_obj_alloc(vmarea_allocator);
         if (newvma) {
                 newvma->vma_vmmap = NULL;
+                newvma->vma_advice = MADV_NORMAL;
+                newvma->vma_maxprot = PROT_READ | PROT_WRITE | PROT_EXEC;
         }
         return newvma;
 }
@@ -105,6 +109,256 @@ end:
         return osize - size;
 }
 
+/* ------------------------------------------------------------------ */
+/* -------------------------- VMAREA TREE --------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Besides the sorted vmm_list, which is kept for iteration, the areas of
+ * a map are indexed by an AVL tree ordered by vma_start (vmm_root), so
+ * that finding the area around a page takes O(log n) rather than a walk
+ * of the list. On top of that vmm_cache remembers the area the last
+ * lookup hit, which catches the common case of consecutive faults and
+ * copies within one area.
+ *
+ * Every node also summarizes its subtree for vmmap_find_range(): the
+ * lowest start (vma_tmin), the highest end (vma_tmax) and the largest gap
+ * between two consecutive areas of the subtree (vma_tgap). A subtree
+ * whose largest gap is too small can be skipped entirely, so the first
+ * fit in either direction is found in O(log n).
+ *
+ * Areas never overlap, so moving the start or end of an area within the
+ * space around it does not change its place in the tree, but the gap
+ * summaries above it must be refreshed with vmmap_resized().
+ */
+
+#define vmarea_height(vma) ((NULL == (vma)) ? 0 : (vma)->vma_theight)
+
+/* Recompute the height and the gap summary of vma's subtree from its
+ * children. */
+static void
+vmarea_tree_update(vmarea_t *vma)
+{
+        vmarea_t *l = vma->vma_tleft, *r = vma->vma_tright;
+
+        vma->vma_theight = 1 + MAX(vmarea_height(l), vmarea_height(r));
+
+        vma->vma_tmin = vma->vma_start;
+        vma->vma_tmax = vma->vma_end;
+        vma->vma_tgap = 0;
+        if (NULL != l) {
+                vma->vma_tmin = l->vma_tmin;
+                vma->vma_tgap = MAX(l->vma_tgap, vma->vma_start - l->vma_tmax);
+        }
+        if (NULL != r) {
+                vma->vma_tmax = r->vma_tmax;
+                vma->vma_tgap = MAX(vma->vma_tgap,
+                                    MAX(r->vma_tgap, r->vma_tmin - vma->vma_end));
+        }
+}
+
+static vmarea_t *
+vmarea_tree_rotate_left(vmarea_t *vma)
+{
+        vmarea_t *r = vma->vma_tright;
+
+        vma->vma_tright = r->vma_tleft;
+        r->vma_tleft = vma;
+        vmarea_tree_update(vma);
+        vmarea_tree_update(r);
+        return r;
+}
+
+static vmarea_t *
+vmarea_tree_rotate_right(vmarea_t *vma)
+{
+        vmarea_t *l = vma->vma_tleft;
+
+        vma->vma_tleft = l->vma_tright;
+        l->vma_tright = vma;
+        vmarea_tree_update(vma);
+        vmarea_tree_update(l);
+        return l;
+}
+
+/* Restore the AVL property at vma, whose subtrees are balanced and differ
+ * in height by at most two. Returns the new root of the subtree. */
+static vmarea_t *
+vmarea_tree_balance(vmarea_t *vma)
+{
+        int diff;
+
+        vmarea_tree_update(vma);
+        diff = vmarea_height(vma->vma_tleft) - vmarea_height(vma->vma_tright);
+
+        if (diff > 1) {
+                if (vmarea_height(vma->vma_tleft->vma_tleft)
+                    < vmarea_height(vma->vma_tleft->vma_tright))
+                        vma->vma_tleft = vmarea_tree_rotate_left(vma->vma_tleft);
+                return vmarea_tree_rotate_right(vma);
+        }
+        if (diff < -1) {
+                if (vmarea_height(vma->vma_tright->vma_tright)
+                    < vmarea_height(vma->vma_tright->vma_tleft))
+                        vma->vma_tright = vmarea_tree_rotate_right(vma->vma_tright);
+                return vmarea_tree_rotate_left(vma);
+        }
+        return vma;
+}
+
+static vmarea_t *
+vmarea_tree_insert(vmarea_t *root, vmarea_t *vma)
+{
+        if (NULL == root) {
+                vma->vma_tleft = vma->vma_tright = NULL;
+                vma->vma_theight = 1;
+                return vma;
+        }
+
+        KASSERT(vma->vma_start != root->vma_start);
+        if (vma->vma_start < root->vma_start)
+                root->vma_tleft = vmarea_tree_insert(root->vma_tleft, vma);
+        else
+                root->vma_tright = vmarea_tree_insert(root->vma_tright, vma);
+        return vmarea_tree_balance(root);
+}
+
+/* Detach the leftmost area of the subtree; it is returned in *min. */
+static vmarea_t *
+vmarea_tree_remove_min(vmarea_t *root, vmarea_t **min)
+{
+        if (NULL == root->vma_tleft) {
+                *min = root;
+                return root->vma_tright;
+        }
+        root->vma_tleft = vmarea_tree_remove_min(root->vma_tleft, min);
+        return vmarea_tree_balance(root);
+}
+
+static vmarea_t *
+vmarea_tree_remove(vmarea_t *root, vmarea_t *vma)
+{
+        vmarea_t *min;
+
+        KASSERT(NULL != root);
+        if (vma->vma_start < root->vma_start) {
+                root->vma_tleft = vmarea_tree_remove(root->vma_tleft, vma);
+        } else if (vma->vma_start > root->vma_start) {
+                root->vma_tright = vmarea_tree_remove(root->vma_tright, vma);
+        } else {
+                KASSERT(vma == root);
+                if (NULL == root->vma_tright)
+                        return root->vma_tleft;
+                root->vma_tright = vmarea_tree_remove_min(root->vma_tright, &min);
+                min->vma_tleft = root->vma_tleft;
+                min->vma_tright = root->vma_tright;
+                root = min;
+        }
+        return vmarea_tree_balance(root);
+}
+
+/* Returns the area with the highest vma_start <= vfn, or NULL. */
+static vmarea_t *
+vmarea_tree_floor(vmarea_t *root, uint32_t vfn)
+{
+        vmarea_t *best = NULL;
+
+        while (NULL != root) {
+                if (root->vma_start <= vfn) {
+                        best = root;
+                        root = root->vma_tright;
+                } else {
+                        root = root->vma_tleft;
+                }
+        }
+        return best;
+}
+
+/* Recompute the summaries on the path from the root down to vma. */
+static void
+vmarea_tree_refresh(vmarea_t *root, vmarea_t *vma)
+{
+        KASSERT(NULL != root);
+        if (vma->vma_start < root->vma_start)
+                vmarea_tree_refresh(root->vma_tleft, vma);
+        else if (vma->vma_start > root->vma_start)
+                vmarea_tree_refresh(root->vma_tright, vma);
+        vmarea_tree_update(root);
+}
+
+/*
+ * Lowest start of a gap of at least npages pages among the gaps inside
+ * the subtree and the gap between prev_end (the end of whatever precedes
+ * the subtree) and the subtree's first area. -1 if there is none.
+ */
+static int
+vmarea_tree_lowest_gap(vmarea_t *root, uint32_t prev_end, uint32_t npages)
+{
+        uint32_t below;
+        int ret;
+
+        if (NULL == root)
+                return -1;
+        if (root->vma_tmin - prev_end >= npages)
+                return prev_end;
+        if (root->vma_tgap < npages)
+                return -1;
+
+        if (0 <= (ret = vmarea_tree_lowest_gap(root->vma_tleft, prev_end, npages)))
+                return ret;
+        below = (NULL == root->vma_tleft) ? prev_end : root->vma_tleft->vma_tmax;
+        if (root->vma_start - below >= npages)
+                return below;
+        return vmarea_tree_lowest_gap(root->vma_tright, root->vma_end, npages);
+}
+
+/*
+ * Highest start for npages pages that fit in one of the gaps inside the
+ * subtree or in the gap between the subtree's last area and next_start
+ * (the start of whatever follows the subtree). -1 if there is none.
+ */
+static int
+vmarea_tree_highest_gap(vmarea_t *root, uint32_t next_start, uint32_t npages)
+{
+        uint32_t above;
+        int ret;
+
+        if (NULL == root)
+                return -1;
+        if (next_start - root->vma_tmax >= npages)
+                return next_start - npages;
+        if (root->vma_tgap < npages)
+                return -1;
+
+        if (0 <= (ret = vmarea_tree_highest_gap(root->vma_tright, next_start, npages)))
+                return ret;
+        above = (NULL == root->vma_tright) ? next_start : root->vma_tright->vma_tmin;
+        if (above - root->vma_end >= npages)
+                return above - npages;
+        return vmarea_tree_highest_gap(root->vma_tleft, root->vma_start, npages);
+}
+
+/*
+ * Must be called after the start or end of an area already in the map
+ * has been moved (without making it overlap another area).
+ */
+void
+vmmap_resized(vmmap_t *map, vmarea_t *vma)
+{
+        KASSERT(map == vma->vma_vmmap);
+        vmarea_tree_refresh(map->vmm_root, vma);
+}
+
+/* Take an area out of both the list and the tree of its map. */
+static void
+vmmap_unlink(vmmap_t *map, vmarea_t *vma)
+{
+        list_remove(&vma->vma_plink);
+        map->vmm_root = vmarea_tree_remove(map->vmm_root, vma);
+        if (map->vmm_cache == vma)
+                map->vmm_cache = NULL;
+}
+
 /* Create a new vmmap, which has no vmareas and does
  * not refer to a process. */
 vmmap_t *
@@ -118,6 +372,8 @@ vmmap_create(void)
         dbg(DBG_PRINT, "(GRADING3A)\n");
         if(map!=NULL){
             list_init(&(map->vmm_list));
+            map->vmm_root = NULL;
+            map->vmm_cache = NULL;
             map->vmm_proc = NULL;
             dbg(DBG_PRINT, "(GRADING3A)\n");
         }
@@ -134,10 +390,14 @@ vmmap_destroy(vmmap_t *map)
         KASSERT(NULL != map);
         dbg(DBG_PRINT, "(GRADING3A 3.a)\n");
         vmarea_t* iter = NULL;
+
+        if(map->vmm_proc != NULL){
+            pframe_rmap_remove(map->vmm_proc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+        }
         list_iterate_begin(&map->vmm_list, iter, vmarea_t, vma_plink) {
 
             list_remove(&(iter->vma_olink));
-            list_remove(&(iter->vma_plink));
+            vmmap_unlink(map, iter);
             iter->vma_obj->mmo_ops->put(iter->vma_obj);
             iter->vma_obj=NULL;
             vmarea_free(iter);
@@ -165,23 +425,19 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
         KASSERT(ADDR_TO_PN(USER_MEM_LOW) <= newvma->vma_start && ADDR_TO_PN(USER_MEM_HIGH) >= newvma->vma_end);
         dbg(DBG_PRINT, "(GRADING3A 3.b)\n");
 
-        vmarea_t* iter = NULL;
-        vmarea_t* holder = NULL;
+        vmarea_t* holder = vmarea_tree_floor(map->vmm_root, newvma->vma_start);
         newvma->vma_vmmap = map;
 
-        list_iterate_begin(&map->vmm_list, iter, vmarea_t, vma_plink) {
-
-            if(newvma->vma_start <= iter->vma_start){
-                holder = iter;
-                list_insert_tail(&holder->vma_plink, &newvma->vma_plink);
-                dbg(DBG_PRINT, "(GRADING3A 3)\n");
-                return;
-            }
+        /* the list stays sorted: the new area goes right after the area
+         * that precedes it in the tree, or first if there is none */
+        if(holder != NULL){
+            list_insert_head(&holder->vma_plink, &newvma->vma_plink);
             dbg(DBG_PRINT, "(GRADING3A 3)\n");
-
-        } list_iterate_end();
-
-        list_insert_tail(&map->vmm_list, &newvma->vma_plink);
+        }else{
+            list_insert_head(&map->vmm_list, &newvma->vma_plink);
+            dbg(DBG_PRINT, "(GRADING3A 3)\n");
+        }
+        map->vmm_root = vmarea_tree_insert(map->vmm_root, newvma);
         dbg(DBG_PRINT, "(GRADING3A 3)\n");
 }
 
@@ -191,75 +447,44 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
  *
  * Your algorithm should be first fit. If dir is VMMAP_DIR_HILO, you
  * should find a gap as high in the address space as possible; if dir
- * is VMMAP_DIR_LOHI, the gap should be as low as possible. */
+ * is VMMAP_DIR_LOHI, the gap should be as low as possible.
+ *
+ * The gap summaries in the area tree let both directions skip every
+ * subtree without a big enough gap. */
 int
 vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
 {
         //NOT_YET_IMPLEMENTED("VM: vmmap_find_range");
         //return -1;
 
-        vmarea_t* iter = NULL;
-        vmarea_t* holder = NULL;
+        uint32_t lo = ADDR_TO_PN(USER_MEM_LOW);
+        uint32_t hi = ADDR_TO_PN(USER_MEM_HIGH);
+        vmarea_t* root = map->vmm_root;
 
         int retVal = -1;
 
-        if(dir == VMMAP_DIR_HILO){
-            
-            list_iterate_reverse(&map->vmm_list, iter, vmarea_t, vma_plink) {
-
-                if(holder == NULL && npages <= ADDR_TO_PN(USER_MEM_HIGH) - iter->vma_end){
-                    retVal = ADDR_TO_PN(USER_MEM_HIGH) - npages;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                    break;
-
-                }else if(holder != NULL && npages <= (holder->vma_start-iter->vma_end)){
-                    retVal = holder->vma_start-npages;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                    break;
-                }else{
-                    holder = iter;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                }
+        if(root == NULL){
+            if(npages <= hi - lo){
+                retVal = (dir == VMMAP_DIR_HILO) ? (int)(hi - npages) : (int)lo;
+                dbg(DBG_PRINT, "(GRADING3A)\n");
+            }
+        }
+        else if(dir == VMMAP_DIR_HILO){
+            /* the gap above the last area and every gap in between, from the
+             * top down, then the gap below the first area */
+            retVal = vmarea_tree_highest_gap(root, hi, npages);
+            if(retVal<0 && npages <= root->vma_tmin - lo){
+                retVal = root->vma_tmin - npages;
                 dbg(DBG_PRINT, "(GRADING3A)\n");
-
-            } list_iterate_end();
-
-            if(retVal<0 && npages <= (holder->vma_start - ADDR_TO_PN(USER_MEM_LOW))){
-                    retVal = holder->vma_start-npages;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
             }
-
             dbg(DBG_PRINT, "(GRADING3A)\n");
 
         }else if(dir == VMMAP_DIR_LOHI){
-
-            list_iterate_begin(&map->vmm_list, iter, vmarea_t, vma_plink){
-
-                if(holder==NULL && npages <= (iter->vma_start - ADDR_TO_PN(USER_MEM_LOW))){
-                    retVal = ADDR_TO_PN(USER_MEM_LOW);
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                    break;
-                }else if(holder != NULL && npages <= (iter->vma_start - holder->vma_end)){
-                    retVal = holder->vma_end;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                    break;
-                }else{
-                    holder = iter;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                }
+            retVal = vmarea_tree_lowest_gap(root, lo, npages);
+            if(retVal<0 && npages <= hi - root->vma_tmax){
+                retVal = root->vma_tmax;
                 dbg(DBG_PRINT, "(GRADING3A)\n");
-            } list_iterate_end();
-
-            if(retVal<0){
-                if(holder==NULL && npages <= (ADDR_TO_PN(USER_MEM_HIGH) - ADDR_TO_PN(USER_MEM_LOW))){
-                    retVal = ADDR_TO_PN(USER_MEM_LOW);
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                }else if(npages <= (ADDR_TO_PN(USER_MEM_HIGH)-holder->vma_end)){
-                    retVal = holder->vma_end;
-                    dbg(DBG_PRINT, "(GRADING3A)\n");
-                }
             }
-
             dbg(DBG_PRINT, "(GRADING3A)\n");
         }
 
@@ -268,9 +493,9 @@ vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
         return retVal;
 }
 
-/* Find the vm_area that vfn lies in. Simply scan the address space
- * looking for a vma whose range covers vfn. If the page is unmapped,
- * return NULL. */
+/* Find the vm_area that vfn lies in. The last area hit is tried first,
+ * then the area tree is searched for the area starting closest below vfn.
+ * If the page is unmapped, return NULL. */
 vmarea_t *
 vmmap_lookup(vmmap_t *map, uint32_t vfn)
 {
@@ -279,15 +504,19 @@ vmmap_lookup(vmmap_t *map, uint32_t vfn)
         KASSERT(NULL != map);
         dbg(DBG_PRINT, "(GRADING3A 3.c)\n");
 
-        vmarea_t* iter = NULL;
+        vmarea_t* iter = map->vmm_cache;
 
-        list_iterate_begin(&map->vmm_list, iter, vmarea_t, vma_plink) {
-            if(vfn >= iter->vma_start && vfn < iter->vma_end){
-                dbg(DBG_PRINT, "(GRADING3A 3)\n");
-                return iter;
-            }
+        if(iter != NULL && vfn >= iter->vma_start && vfn < iter->vma_end){
             dbg(DBG_PRINT, "(GRADING3A 3)\n");
-        } list_iterate_end();
+            return iter;
+        }
+
+        iter = vmarea_tree_floor(map->vmm_root, vfn);
+        if(iter != NULL && vfn < iter->vma_end){
+            map->vmm_cache = iter;
+            dbg(DBG_PRINT, "(GRADING3A 3)\n");
+            return iter;
+        }
         dbg(DBG_PRINT, "(GRADING3A 3)\n");
         return NULL;
 }
@@ -295,7 +524,11 @@ vmmap_lookup(vmmap_t *map, uint32_t vfn)
 /* Allocates a new vmmap containing a new vmarea for each area in the
  * given map. The areas should have no mmobjs set yet. Returns pointer
  * to the new vmmap on success, NULL on failure. This function is
- * called when implementing fork(2). */
+ * called when implementing fork(2).
+ *
+ * The areas of the new map are in the same order as the areas of the
+ * given map they were cloned from, so a caller can pair them up by
+ * walking both lists side by side instead of looking each one up. */
 vmmap_t *
 vmmap_clone(vmmap_t *map)
 {
@@ -316,12 +549,15 @@ vmmap_clone(vmmap_t *map)
 
             area->vma_flags = iter->vma_flags;
             area->vma_prot = iter->vma_prot;
+            area->vma_advice = iter->vma_advice;
+            area->vma_maxprot = iter->vma_maxprot;
             area->vma_vmmap = ret_map;
 
             list_link_init(&area->vma_olink);
             list_link_init(&area->vma_plink);
 
             list_insert_tail(&ret_map->vmm_list, &area->vma_plink);
+            ret_map->vmm_root = vmarea_tree_insert(ret_map->vmm_root, area);
 
             dbg(DBG_PRINT, "(GRADING3A)\n");
 
@@ -332,6 +568,124 @@ vmmap_clone(vmmap_t *map)
         return ret_map;
 }
 
+/* ---- MERGING ---- */
+
+/*
+ * Programs that allocate with many small anonymous mmaps, or that map a
+ * region piece by piece, would otherwise leave long runs of small areas
+ * behind, each with an object of its own. vmmap_map() instead grows an
+ * adjacent anonymous private area with the same protection (and no
+ * madvise advice) over the new range, and areas that end up next to each
+ * other with the same object, lined-up offsets, the same protection and
+ * the same advice are folded into one.
+ *
+ * Anonymous private areas use their first virtual page as their offset,
+ * so the offsets of two such areas always line up no matter where they
+ * were mapped. Growing an area over a range is only allowed if no object
+ * in its shadow chain has ever held a page in that range, e.g. one left
+ * over from an earlier unmap, since the new range has to read as zeros.
+ * This is checked against the span of pages each object has held rather
+ * than page by page; if the spans overlap the range, a new area is made
+ * instead.
+ */
+
+/* Can b, which starts where a ends, be folded into a? */
+static int
+vmarea_mergeable(vmarea_t *a, vmarea_t *b)
+{
+        return (a->vma_end == b->vma_start)
+               && (a->vma_obj == b->vma_obj)
+               && (a->vma_prot == b->vma_prot)
+               && (a->vma_maxprot == b->vma_maxprot)
+               && (a->vma_advice == b->vma_advice)
+               && ((a->vma_flags & MAP_TYPE) == (b->vma_flags & MAP_TYPE))
+               && (a->vma_off + (a->vma_end - a->vma_start) == b->vma_off);
+}
+
+/* Fold b into a. b is unlinked and freed. */
+static void
+vmmap_merge(vmmap_t *map, vmarea_t *a, vmarea_t *b)
+{
+        KASSERT(vmarea_mergeable(a, b));
+
+        vmmap_unlink(map, b);
+        list_remove(&b->vma_olink);
+        a->vma_end = b->vma_end;
+        vmmap_resized(map, a);
+
+        b->vma_obj->mmo_ops->put(b->vma_obj);
+        b->vma_obj = NULL;
+        vmarea_free(b);
+}
+
+/*
+ * Fold the areas directly before and after vma into it where possible.
+ * Returns the area that now covers vma's range (vma itself, or the area
+ * before it if vma was folded into that one).
+ */
+vmarea_t *
+vmmap_coalesce(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *other;
+
+        if (vma->vma_plink.l_prev != &map->vmm_list) {
+                other = list_item(vma->vma_plink.l_prev, vmarea_t, vma_plink);
+                if (vmarea_mergeable(other, vma)) {
+                        vmmap_merge(map, other, vma);
+                        vma = other;
+                }
+        }
+        if (vma->vma_plink.l_next != &map->vmm_list) {
+                other = list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
+                if (vmarea_mergeable(vma, other))
+                        vmmap_merge(map, vma, other);
+        }
+        return vma;
+}
+
+/* Can the anonymous private area vma be grown over the npages pages at
+ * lopage, for a mapping with the given protection and flags? */
+static int
+vmarea_extendable(vmarea_t *vma, uint32_t lopage, uint32_t npages,
+                  int prot, int flags)
+{
+        return (vma->vma_prot == prot) && (MADV_NORMAL == vma->vma_advice)
+               && ((vma->vma_flags & MAP_TYPE) == (flags & MAP_TYPE))
+               && (MAP_PRIVATE & flags)
+               && (vma->vma_off == vma->vma_start)
+               && shadow_range_untouched(vma->vma_obj, lopage, npages);
+}
+
+/*
+ * Map npages anonymous private pages at lopage by growing the area that
+ * ends right below or starts right above the range. The range must be
+ * empty. Returns the area now covering the range, or NULL if neither
+ * neighbour can be grown.
+ */
+static vmarea_t *
+vmmap_extend_anon(vmmap_t *map, uint32_t lopage, uint32_t npages,
+                  int prot, int flags)
+{
+        vmarea_t *vma;
+
+        vma = vmmap_lookup(map, lopage - 1);
+        if ((NULL != vma) && vmarea_extendable(vma, lopage, npages, prot, flags)) {
+                vma->vma_end = lopage + npages;
+                vmmap_resized(map, vma);
+                return vmmap_coalesce(map, vma);
+        }
+
+        vma = vmmap_lookup(map, lopage + npages);
+        if ((NULL != vma) && vmarea_extendable(vma, lopage, npages, prot, flags)) {
+                vma->vma_start = lopage;
+                vma->vma_off = lopage;
+                vmmap_resized(map, vma);
+                return vmmap_coalesce(map, vma);
+        }
+
+        return NULL;
+}
+
 /* Insert a mapping into the map starting at lopage for npages pages.
  * If lopage is zero, we will find a range of virtual addresses in the
  * process that is big enough, by using vmmap_find_range with the same
@@ -356,6 +710,9 @@ vmmap_clone(vmmap_t *map)
  * is no chance of failure.
  *
  * If 'new' is non-NULL a pointer to the new vmarea_t should be stored in it.
+ * An anonymous private mapping may be merged into a neighbouring area
+ * (see above), in which case that area, which covers more than the new
+ * range, is stored instead.
  */
 int
 vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
@@ -377,8 +734,6 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
         KASSERT(PAGE_ALIGNED(off));
         dbg(DBG_PRINT, "(GRADING3A 3.d)\n");
 
-        vmarea_t* area = vmarea_alloc();
-
         if(lopage != 0){
             int res = vmmap_is_range_empty(map, lopage, npages);
             if(res == 0){
@@ -400,7 +755,18 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
             dbg(DBG_PRINT, "(GRADING3A 3)\n");
         }
 
-        area->vma_off = ADDR_TO_PN(off);
+        vmarea_t* area = NULL;
+
+        if(!file && (area = vmmap_extend_anon(map, lopage, npages, prot, flags))){
+            if(new != NULL){
+                *new = area;
+            }
+            return 0;
+        }
+
+        area = vmarea_alloc();
+
+        area->vma_off = file ? ADDR_TO_PN(off) : lopage;
         area->vma_start = lopage;
         area->vma_end = lopage + npages;
 
@@ -453,6 +819,485 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
         return 0;
 }
 
+/*
+ * Split vma at vfn, which must lie strictly inside it: vma keeps
+ * [vma_start, vfn) and a new area, inserted right after it, gets
+ * [vfn, vma_end). Both keep mapping the same object at the same offsets,
+ * so they can be merged again later. Returns the new area.
+ */
+static vmarea_t *
+vmmap_split(vmmap_t *map, vmarea_t *vma, uint32_t vfn)
+{
+        vmarea_t *area = vmarea_alloc();
+
+        KASSERT((vma->vma_start < vfn) && (vfn < vma->vma_end));
+
+        area->vma_off = vma->vma_off + vfn - vma->vma_start;
+        area->vma_start = vfn;
+        area->vma_end = vma->vma_end;
+        area->vma_prot = vma->vma_prot;
+        area->vma_flags = vma->vma_flags;
+        area->vma_advice = vma->vma_advice;
+        area->vma_maxprot = vma->vma_maxprot;
+        area->vma_vmmap = map;
+        area->vma_obj = vma->vma_obj;
+        area->vma_obj->mmo_ops->ref(area->vma_obj);
+        list_link_init(&area->vma_olink);
+        list_link_init(&area->vma_plink);
+
+        vma->vma_end = vfn;
+        vmmap_resized(map, vma);
+
+        list_insert_head(&vma->vma_plink, &area->vma_plink);
+        map->vmm_root = vmarea_tree_insert(map->vmm_root, area);
+        list_insert_tail(mmobj_bottom_vmas(area->vma_obj), &area->vma_olink);
+
+        return area;
+}
+
+/*
+ * Returns the area containing lopage if every page of [lopage, hipage) is
+ * mapped, and NULL otherwise.
+ */
+static vmarea_t *
+vmmap_range_mapped(vmmap_t *map, uint32_t lopage, uint32_t hipage)
+{
+        vmarea_t *first, *vma, *next;
+
+        if (NULL == (first = vmmap_lookup(map, lopage)))
+                return NULL;
+        for (vma = first; vma->vma_end < hipage; vma = next) {
+                if (vma->vma_plink.l_next == &map->vmm_list)
+                        return NULL;
+                next = list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
+                if (next->vma_start != vma->vma_end)
+                        return NULL;
+        }
+        return first;
+}
+
+/*
+ * Split the areas straddling either end of the mapped range [lopage,
+ * hipage), so that the range is covered by whole areas, and return the
+ * first of them.
+ */
+static vmarea_t *
+vmmap_clip(vmmap_t *map, vmarea_t *first, uint32_t lopage, uint32_t hipage)
+{
+        vmarea_t *last;
+
+        if (first->vma_start < lopage)
+                first = vmmap_split(map, first, lopage);
+        last = vmmap_lookup(map, hipage - 1);
+        if (hipage < last->vma_end)
+                vmmap_split(map, last, hipage);
+        return first;
+}
+
+/* The area after vma in its map, which must exist. */
+#define vmarea_next(vma) list_item((vma)->vma_plink.l_next, vmarea_t, vma_plink)
+
+/*
+ * Merge the areas of the range starting with first and ending at hipage,
+ * and the areas on either side of it, wherever they line up again after
+ * vmmap_clip() and a change to their attributes.
+ */
+static void
+vmmap_coalesce_range(vmmap_t *map, vmarea_t *first, uint32_t hipage)
+{
+        vmarea_t *vma;
+
+        for (vma = first; ; vma = vmarea_next(vma)) {
+                vma = vmmap_coalesce(map, vma);
+                if ((hipage <= vma->vma_end) || (vma->vma_plink.l_next == &map->vmm_list))
+                        break;
+        }
+}
+
+/*
+ * Change the protection of the npages pages starting at lopage, all of
+ * which must be mapped, to prot. Areas that straddle either end of the
+ * range are split first, and afterwards the areas in and around the range
+ * are merged wherever they line up again.
+ *
+ * Mappings that lose write access are write-protected in place and
+ * mappings that lose all access are removed; pages that gain access are
+ * left alone and pick up the new protection on their next fault (which is
+ * also where copy-on-write happens). The caller must flush the TLB.
+ *
+ * Returns 0 on success, -ENOMEM if part of the range is not mapped, or
+ * -EACCES if prot asks for more than some area in the range may have (see
+ * vma_maxprot); nothing is changed on error.
+ */
+int
+vmmap_protect(vmmap_t *map, uint32_t lopage, uint32_t npages, int prot)
+{
+        uint32_t hipage = lopage + npages;
+        vmarea_t *first, *vma;
+
+        if (NULL == (first = vmmap_range_mapped(map, lopage, hipage)))
+                return -ENOMEM;
+        for (vma = first; ; vma = vmarea_next(vma)) {
+                if (prot & ~vma->vma_maxprot)
+                        return -EACCES;
+                if (hipage <= vma->vma_end)
+                        break;
+        }
+        first = vmmap_clip(map, first, lopage, hipage);
+
+        for (vma = first; ; vma = vmarea_next(vma)) {
+                vma->vma_prot = prot;
+                if (vma->vma_end == hipage)
+                        break;
+        }
+
+        if (PROT_NONE == prot) {
+                pframe_rmap_remove(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+                pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+        } else if (!(PROT_WRITE & prot)) {
+                pframe_rmap_protect(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+        }
+
+        vmmap_coalesce_range(map, first, hipage);
+        return 0;
+}
+
+/*
+ * Start bringing in the page pagenum of the area's shadow chain from
+ * wherever it is (swap, or the file at the bottom), without waiting for
+ * it. Pages that are resident, or that have never been written and would
+ * read as zeros, are left alone.
+ */
+static void
+vmarea_willneed(vmarea_t *vma, uint32_t pagenum)
+{
+        mmobj_t *o = vma->vma_obj;
+        pframe_t *pf;
+
+        for (; shadow_is_shadow(o); o = o->mmo_shadowed) {
+                if (NULL != pframe_peek(o, pagenum))
+                        return;
+                if (swap_has(o, pagenum)) {
+                        pframe_get_async(o, pagenum, NULL, &pf);
+                        return;
+                }
+        }
+
+        if ((NULL != pframe_peek(o, pagenum)) || anon_untouched(o, pagenum))
+                return;
+        pframe_get_async(o, pagenum, NULL, &pf);
+}
+
+/*
+ * Act on madvise(2) advice for the npages pages starting at lopage, all
+ * of which must be mapped:
+ *
+ *   MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL
+ *      are remembered in vma_advice of the areas covering the range
+ *      (splitting and merging areas as vmmap_protect() does) and tune
+ *      read-ahead, fault-around and replacement in handle_pagefault().
+ *   MADV_WILLNEED
+ *      starts bringing in the pages of the range that are not resident,
+ *      as long as memory is not short.
+ *   MADV_DONTNEED
+ *      unmaps the range and, for private areas, throws away the area's
+ *      own copies of the pages and their swap copies; the pages then
+ *      read as whatever the objects below hold (zeros for anonymous
+ *      memory that was not inherited). Shared pages are only unmapped.
+ *   MADV_FREE
+ *      lets the pager drop the area's own copies of the pages of a
+ *      private anonymous area without writing them to swap, unless they
+ *      are written again first. The range is write-protected so that
+ *      such a write is noticed.
+ *
+ * The caller must flush the TLB. Returns 0 on success, -ENOMEM if part of
+ * the range is not mapped, or -EINVAL for unknown advice and for
+ * MADV_FREE on anything but private anonymous memory.
+ */
+int
+vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice)
+{
+        uint32_t hipage = lopage + npages;
+        vmarea_t *first, *vma;
+        uint32_t vfn, pagenum;
+        pframe_t *pf;
+
+        if (NULL == (first = vmmap_range_mapped(map, lopage, hipage)))
+                return -ENOMEM;
+
+        switch (advice) {
+                case MADV_NORMAL:
+                case MADV_RANDOM:
+                case MADV_SEQUENTIAL:
+                        first = vmmap_clip(map, first, lopage, hipage);
+                        for (vma = first; ; vma = vmarea_next(vma)) {
+                                vma->vma_advice = advice;
+                                if (vma->vma_end == hipage)
+                                        break;
+                        }
+                        vmmap_coalesce_range(map, first, hipage);
+                        return 0;
+
+                case MADV_WILLNEED:
+                        for (vma = first; ; vma = vmarea_next(vma)) {
+                                for (vfn = MAX(lopage, vma->vma_start);
+                                     vfn < MIN(hipage, vma->vma_end); ++vfn) {
+                                        if (pframe_memory_low())
+                                                return 0;
+                                        vmarea_willneed(vma, vfn - vma->vma_start + vma->vma_off);
+                                }
+                                if (hipage <= vma->vma_end)
+                                        break;
+                        }
+                        return 0;
+
+                case MADV_DONTNEED:
+                        pframe_rmap_remove(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+                        pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+                        /* dropping pages may block, so look each area up
+                         * again rather than holding on to one */
+                        for (vfn = lopage; vfn < hipage; ++vfn) {
+                                if (NULL == (vma = vmmap_lookup(map, vfn)))
+                                        continue;
+                                if (!(MAP_PRIVATE & vma->vma_flags)) {
+                                        vfn = vma->vma_end - 1;
+                                        continue;
+                                }
+                                pagenum = vfn - vma->vma_start + vma->vma_off;
+                                pframe_discard(vma->vma_obj, pagenum);
+                                if (swap_has(vma->vma_obj, pagenum))
+                                        swap_forget(vma->vma_obj, pagenum);
+                        }
+                        return 0;
+
+                case MADV_FREE:
+                        for (vma = first; ; vma = vmarea_next(vma)) {
+                                if (!(MAP_PRIVATE & vma->vma_flags)
+                                    || !anon_is_anon(mmobj_bottom_obj(vma->vma_obj)))
+                                        return -EINVAL;
+                                if (hipage <= vma->vma_end)
+                                        break;
+                        }
+                        pframe_rmap_protect(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(hipage));
+                        for (vma = first; ; vma = vmarea_next(vma)) {
+                                for (vfn = MAX(lopage, vma->vma_start);
+                                     vfn < MIN(hipage, vma->vma_end); ++vfn) {
+                                        pagenum = vfn - vma->vma_start + vma->vma_off;
+                                        pf = pframe_peek(vma->vma_obj, pagenum);
+                                        if ((NULL != pf) && !pframe_lazyfree(pf))
+                                                continue;
+                                        if (swap_has(vma->vma_obj, pagenum))
+                                                swap_forget(vma->vma_obj, pagenum);
+                                }
+                                if (hipage <= vma->vma_end)
+                                        break;
+                        }
+                        return 0;
+
+                default:
+                        return -EINVAL;
+        }
+}
+
+/*
+ * Can the page pagenum, just past the end of vma, be made part of vma
+ * without exposing stale data? Shadow objects must not hold a copy of it
+ * (one left over from before the area was shrunk), and neither must an
+ * anonymous bottom object, since the page has to read as zeros.
+ */
+static int
+vmarea_tail_clean(vmarea_t *vma, uint32_t pagenum)
+{
+        mmobj_t *o;
+
+        for (o = vma->vma_obj; shadow_is_shadow(o); o = o->mmo_shadowed) {
+                if ((NULL != pframe_peek(o, pagenum)) || swap_has(o, pagenum))
+                        return 0;
+        }
+        return !anon_is_anon(o) || anon_untouched(o, pagenum);
+}
+
+/*
+ * Can the part of vma ending at hipage be grown by npages without exposing
+ * stale data? Only the end of the area can grow: past any other hipage the
+ * object's pages already belong to the rest of the area.
+ */
+static int
+vmarea_can_grow(vmarea_t *vma, uint32_t hipage, uint32_t npages)
+{
+        uint32_t off = vma->vma_off + hipage - vma->vma_start;
+        uint32_t i;
+
+        if (hipage != vma->vma_end)
+                return 0;
+
+        for (i = 0; i < npages; ++i) {
+                if (!vmarea_tail_clean(vma, off + i))
+                        return 0;
+        }
+        return 1;
+}
+
+/*
+ * Map the npages free pages at lopage as the continuation of the part of
+ * vma ending at hipage, for when vma itself can't be grown (see
+ * vmarea_can_grow()): an area of its own mapping the same file from where
+ * that part leaves off, or fresh anonymous memory, with the same
+ * protection.
+ */
+static int
+vmmap_map_tail(vmmap_t *map, vmarea_t *vma, uint32_t hipage,
+               uint32_t lopage, uint32_t npages)
+{
+        uint32_t off = vma->vma_off + hipage - vma->vma_start;
+        mmobj_t *bottom = mmobj_bottom_obj(vma->vma_obj);
+        vmarea_t *tail;
+        int ret;
+
+        if (anon_is_anon(bottom))
+                return vmmap_map(map, NULL, lopage, npages, vma->vma_prot,
+                                 vma->vma_flags, 0, VMMAP_DIR_HILO, NULL);
+
+        ret = vmmap_map(map, CONTAINER_OF(bottom, vnode_t, vn_mmobj),
+                        lopage, npages, vma->vma_prot, vma->vma_flags,
+                        (off_t) PN_TO_ADDR(off), VMMAP_DIR_HILO, &tail);
+        if (0 <= ret)
+                tail->vma_maxprot = vma->vma_maxprot;
+        return ret;
+}
+
+/*
+ * Resize the oldpages pages starting at lopage, which must all lie in one
+ * area, to newpages pages, as mremap(2) does:
+ *
+ * - Shrinking unmaps the tail of the range.
+ * - Growing extends the area in place if the range ends where the area
+ *   does and the pages after it are free.
+ * - Otherwise, if maymove is set, the range is moved to a free range of
+ *   newpages pages and grown there. The vmarea itself is moved, keeping
+ *   its object and offsets, and each resident page mapped in the old
+ *   range is mapped at its new address. Page contents are never copied.
+ *   The new mappings are read-only; a write faults once to make its page
+ *   writable again, without copying it.
+ *
+ * A tail that needs an area of its own (see vmarea_can_grow()) is mapped
+ * before anything is moved, so an error leaves the range where it was.
+ *
+ * The caller must flush the TLB. Returns the first page of the range
+ * after the resize, or -EFAULT if the range is not within one area,
+ * -ENOMEM if it can't grow in place and may not move (or there is no
+ * room to move it to), or an error from mapping a separate tail.
+ */
+int
+vmmap_remap(vmmap_t *map, uint32_t lopage, uint32_t oldpages,
+            uint32_t newpages, int maymove)
+{
+        uint32_t hipage = lopage + oldpages;
+        uint32_t vfn;
+        vmarea_t *vma;
+        pframe_t *pf;
+        int newlo, ret, grow;
+
+        vma = vmmap_lookup(map, lopage);
+        if ((NULL == vma) || (vma->vma_end < hipage))
+                return -EFAULT;
+
+        if (newpages <= oldpages) {
+                if (newpages < oldpages)
+                        vmmap_remove(map, lopage + newpages, oldpages - newpages);
+                return lopage;
+        }
+
+        grow = vmarea_can_grow(vma, hipage, newpages - oldpages);
+
+        if ((hipage == vma->vma_end)
+            && (newpages - oldpages <= ADDR_TO_PN(USER_MEM_HIGH) - hipage)
+            && vmmap_is_range_empty(map, hipage, newpages - oldpages)) {
+                if (!grow) {
+                        if (0 > (ret = vmmap_map_tail(map, vma, hipage, hipage, newpages - oldpages)))
+                                return ret;
+                        return lopage;
+                }
+                vma->vma_end += newpages - oldpages;
+                vmmap_resized(map, vma);
+                vmmap_coalesce(map, vma);
+                return lopage;
+        }
+
+        if (!maymove || (0 > (newlo = vmmap_find_range(map, newpages, VMMAP_DIR_HILO))))
+                return -ENOMEM;
+
+        /* set up the tail first if it needs an area of its own, so that
+         * nothing can fail once we have started moving */
+        if (!grow && (0 > (ret = vmmap_map_tail(map, vma, hipage, newlo + oldpages, newpages - oldpages))))
+                return ret;
+
+        /* make the range an area of its own and move it */
+        vma = vmmap_clip(map, vma, lopage, hipage);
+        vmmap_unlink(map, vma);
+        vma->vma_vmmap = NULL;
+        vma->vma_start = newlo;
+        vma->vma_end = newlo + oldpages;
+        vmmap_insert(map, vma);
+
+        for (vfn = 0; vfn < oldpages; ++vfn) {
+                uintptr_t from = (uintptr_t) PN_TO_ADDR(lopage + vfn);
+                uintptr_t to = (uintptr_t) PN_TO_ADDR(newlo + vfn);
+
+                if (NULL == (pf = pframe_rmap_lookup(curproc->p_pagedir, from)))
+                        continue;
+                if (0 > pframe_rmap_add(pf, curproc->p_pagedir, to))
+                        break;
+                pt_map(curproc->p_pagedir, to, pt_virt_to_phys((uintptr_t) pf->pf_addr),
+                       PD_PRESENT | PD_USER, PT_PRESENT | PT_USER);
+        }
+        pframe_rmap_remove(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(lopage), (uintptr_t) PN_TO_ADDR(hipage));
+        pt_unmap_range(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(lopage), (uintptr_t) PN_TO_ADDR(hipage));
+
+        if (grow) {
+                vma->vma_end += newpages - oldpages;
+                vmmap_resized(map, vma);
+        }
+        vmmap_coalesce(map, vma);
+        return newlo;
+}
+
+/*
+ * Write back the dirty file pages mapped shared by the npages pages
+ * starting at lopage, all of which must be mapped (msync(2)). Each area
+ * is resolved to the vnode's mmobj it maps and only the pages of that
+ * object that the range covers are cleaned; private and anonymous areas
+ * have nothing to write back and are skipped. With 'wait' set (MS_SYNC)
+ * we also wait for pages someone else is already writing.
+ *
+ * Returns 0 on success or -ENOMEM if part of the range is not mapped.
+ */
+int
+vmmap_sync(vmmap_t *map, uint32_t lopage, uint32_t npages, int wait)
+{
+        uint32_t hipage = lopage + npages;
+        uint32_t vfn, lo, hi;
+        vmarea_t *vma;
+
+        if (NULL == vmmap_range_mapped(map, lopage, hipage))
+                return -ENOMEM;
+
+        /* cleaning blocks, so look each area up again rather than
+         * walking the list */
+        for (vfn = lopage; vfn < hipage; vfn = hi) {
+                if (NULL == (vma = vmmap_lookup(map, vfn)))
+                        return -ENOMEM;
+                hi = MIN(hipage, vma->vma_end);
+                if (!(MAP_SHARED & vma->vma_flags) || shadow_is_shadow(vma->vma_obj)
+                    || anon_is_anon(vma->vma_obj))
+                        continue;
+
+                lo = vfn - vma->vma_start + vma->vma_off;
+                pframe_clean_range(vma->vma_obj, lo, lo + (hi - vfn), wait);
+        }
+        return 0;
+}
+
 /*
  * We have no guarantee that the region of the address space being
  * unmapped will play nicely with our list of vmareas.
@@ -497,41 +1342,17 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 dbg(DBG_PRINT, "(GRADING3A)\n");
                 if(sum_pages < iter->vma_end){
                     dbg(DBG_PRINT, "(GRADING3A)\n");
-                    vmarea_t* area = vmarea_alloc();
-
-                    area->vma_off = iter->vma_off + sum_pages - iter->vma_start;
-                    area->vma_start = sum_pages;
-                    area->vma_end = iter->vma_end;
-
-                    area->vma_prot = iter->vma_prot;
-                    area->vma_flags = iter->vma_flags;
-                    area->vma_vmmap = map;
-                    area->vma_obj = iter->vma_obj;
+                    vmmap_split(map, iter, sum_pages);
 
                     iter->vma_end = lopage;
-
-                    vmarea_t* new_area = list_item( (iter->vma_plink).l_next, vmarea_t, vma_plink );
-                    list_insert_before( &(new_area->vma_plink), &(area->vma_plink) );
-
-                    mmobj_t* object = iter->vma_obj;
-                    mmobj_t* first_shad = shadow_create();
-                    mmobj_t* second_shad = shadow_create();
-
-                    iter->vma_obj = first_shad;
-                    area->vma_obj = second_shad;
-                    area->vma_obj->mmo_un.mmo_bottom_obj = mmobj_bottom_obj(iter->vma_obj);
-                    iter->vma_obj->mmo_un.mmo_bottom_obj = area->vma_obj->mmo_un.mmo_bottom_obj;
-                    iter->vma_obj->mmo_shadowed = object;
-                    area->vma_obj->mmo_shadowed = iter->vma_obj->mmo_shadowed;
-                    object->mmo_ops->ref(object);
-
-                    list_insert_tail(mmobj_bottom_vmas(object),&(area->vma_olink));
+                    vmmap_resized(map, iter);
 
                     dbg(DBG_PRINT, "(GRADING3A)\n");
                 }
 
                 else if((lopage < iter->vma_end) && (sum_pages >= iter->vma_end)){
                     iter->vma_end = lopage;
+                    vmmap_resized(map, iter);
                     dbg(DBG_PRINT, "(GRADING3A)\n");
                 }
                 dbg(DBG_PRINT, "(GRADING3A)\n");
@@ -539,7 +1360,7 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
             else {
                 if((sum_pages >= iter->vma_end)){
                     list_remove(&(iter->vma_olink));
-                    list_remove(&(iter->vma_plink));
+                    vmmap_unlink(map, iter);
                     iter->vma_obj->mmo_ops->put(iter->vma_obj);
                     iter->vma_obj = NULL;
                     vmarea_free(iter);
@@ -548,6 +1369,7 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 else if((sum_pages < iter->vma_end) && (sum_pages > iter->vma_start)){
                     iter->vma_off = iter->vma_off + sum_pages - iter->vma_start;
                     iter->vma_start = sum_pages;
+                    vmmap_resized(map, iter);
                     dbg(DBG_PRINT, "(GRADING3A)\n");
                 }
                 dbg(DBG_PRINT, "(GRADING3A)\n");
@@ -556,6 +1378,7 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
         } list_iterate_end();
 
         tlb_flush_all();
+        pframe_rmap_remove(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(sum_pages));
         pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)PN_TO_ADDR(sum_pages));
         dbg(DBG_PRINT, "(GRADING3A)\n");
         return 0;
@@ -578,19 +1401,13 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
         KASSERT((startvfn < endvfn) && (ADDR_TO_PN(USER_MEM_LOW) <= startvfn) && (ADDR_TO_PN(USER_MEM_HIGH) >= endvfn));
         dbg(DBG_PRINT, "(GRADING3A 3.e)\n");
 
-        list_iterate_begin(&map->vmm_list, iter, vmarea_t, vma_plink){
-            if(iter->vma_end > startvfn){
-                if(sum_pages<=iter->vma_start){
-                    dbg(DBG_PRINT, "(GRADING3A 3)\n");
-                    continue;
-                }else{
-                    dbg(DBG_PRINT, "(GRADING3A 3)\n");
-                    return 0;
-                }
-                dbg(DBG_PRINT, "(GRADING3A 3)\n");
-            }
+        /* areas don't overlap, so of all the areas starting before the end
+         * of the range, the last one is the only one that can reach into it */
+        iter = vmarea_tree_floor(map->vmm_root, sum_pages - 1);
+        if(iter != NULL && iter->vma_end > startvfn){
             dbg(DBG_PRINT, "(GRADING3A 3)\n");
-        }list_iterate_end();
+            return 0;
+        }
         dbg(DBG_PRINT, "(GRADING3A 3)\n");
         return 1;
 }
@@ -661,6 +1478,23 @@ vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
         return 0;
 }
 
+/*
+ * The kernel has written to a page of 'map' through its object rather than
+ * through the page tables. The process may still map the shared zero page
+ * (or an ancestor's page) read-only at that address, so drop its mapping:
+ * the next access faults the written page in.
+ */
+static void
+vmmap_write_unmap(vmmap_t *map, uint32_t vfn)
+{
+        if (NULL != map->vmm_proc) {
+                uintptr_t va = (uintptr_t) PN_TO_ADDR(vfn);
+                pframe_rmap_remove(map->vmm_proc->p_pagedir, va, va + PAGE_SIZE);
+                pt_unmap(map->vmm_proc->p_pagedir, va);
+                tlb_flush(va);
+        }
+}
+
 /* Write from 'buf' into the virtual address space of 'map' starting at
  * 'vaddr' for size 'count'. To do this, you will need to find the correct
  * vmareas to write into, then find the correct pframes within those vmareas,
@@ -684,6 +1518,7 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
             int result = pframe_lookup(area->vma_obj, ADDR_TO_PN(vaddr)-area->vma_start+area->vma_off, 1, &frame);
             memcpy(((char*)frame->pf_addr)+PAGE_OFFSET(vaddr), buf, count);
             pframe_dirty(frame);
+            vmmap_write_unmap(map, ADDR_TO_PN(vaddr));
 
             dbg(DBG_PRINT, "(GRADING3A)\n");
 
@@ -702,6 +1537,7 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
             buf = ((char*)buf+PAGE_SIZE-PAGE_OFFSET(vaddr));
 
             pframe_dirty(fill_frame);
+            vmmap_write_unmap(map, curr_page);
             curr_page=curr_page+1;
             dbg(DBG_PRINT, "(GRADING3A)\n");
         }
@@ -717,6 +1553,7 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
             buf = ((char*)buf+PAGE_OFFSET((int)vaddr-1+count));
 
             pframe_dirty(fill_frame);
+            vmmap_write_unmap(map, curr_page);
             curr_page=curr_page+1;
             dbg(DBG_PRINT, "(GRADING3A)\n");
         }
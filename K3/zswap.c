@@ -0,0 +1,430 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/init.h"
+
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/pframe.h"
+
+#include "vm/zswap.h"
+
+/*
+ * Compressed swap cache.
+ *
+ * This is the first tier of swap (see swap.c). When an anonymous page is
+ * swapped out we first try to compress it with a small LZ77 codec (the
+ * LZF format) and keep the result in memory; only pages that do not
+ * compress to at most 3/4 of a page, or that do not fit in the pool, go on
+ * to the swap disk. Faulting a compressed page back in costs a
+ * decompression instead of a disk read.
+ *
+ * Compressed pages are kept in a handful of size classes, each backed by
+ * its own slab allocator, so that a 300 byte page does not take up a whole
+ * page frame. The pool as a whole may grow to 1/8 of the memory that was
+ * free at boot.
+ *
+ * Loads are exclusive: the compressed copy is freed when the page is read
+ * back in, and it is up to the caller to mark the page dirty.
+ */
+
+#define ZSWAP_HASH_SIZE 256
+#define ZSWAP_MAX_LEN   (PAGE_SIZE - (PAGE_SIZE >> 2))
+#define ZSWAP_NCLASSES  (sizeof(zswap_class_size) / sizeof(zswap_class_size[0]))
+
+typedef struct zswap_entry {
+        mmobj_t         *ze_obj;
+        uint32_t         ze_pagenum;
+        uint16_t         ze_len;        /* compressed length */
+        uint16_t         ze_class;      /* index into zswap_class_size */
+        void            *ze_data;
+        list_link_t      ze_hlink;      /* on a zswap_hash chain */
+        list_link_t      ze_olink;      /* on a zswap_obj_hash chain */
+} zswap_entry_t;
+
+#define hash_zswap(o, pagenum)  ((((uint32_t)(o)) + (pagenum)) % ZSWAP_HASH_SIZE)
+#define hash_zswap_obj(o)       ((((uint32_t)(o)) >> 4) % ZSWAP_HASH_SIZE)
+
+static const uint32_t zswap_class_size[] = {
+        64, 128, 256, 512, 1024, 1536, 2048, ZSWAP_MAX_LEN
+};
+static const char *zswap_class_name[] = {
+        "zswap-64", "zswap-128", "zswap-256", "zswap-512",
+        "zswap-1024", "zswap-1536", "zswap-2048", "zswap-3072"
+};
+static slab_allocator_t *zswap_class_allocator[ZSWAP_NCLASSES];
+static slab_allocator_t *zswap_entry_allocator;
+
+static list_t zswap_hash[ZSWAP_HASH_SIZE];
+static list_t zswap_obj_hash[ZSWAP_HASH_SIZE];
+
+static uint32_t zswap_pool_max = 0;
+
+/* Statistics, for debugging/verification purposes and the vmstat command */
+uint32_t zswap_stored_pages = 0;        /* pages currently compressed */
+uint32_t zswap_stored_bytes = 0;        /* their total compressed length */
+uint32_t zswap_pool_bytes = 0;          /* the same, rounded up to size classes */
+uint32_t zswap_rejects = 0;             /* stores refused (too big or no room) */
+uint32_t zswap_loads = 0;               /* pages faulted back in */
+uint32_t zswap_load_cycles_avg = 0;     /* moving average of the cost of a load */
+uint32_t zswap_load_cycles_max = 0;     /* and the worst one seen */
+
+/* Compression scratch space. Compression never blocks, so one set of
+ * buffers is enough. */
+#define ZSWAP_HLOG      12
+static uint16_t zswap_htab[1 << ZSWAP_HLOG];
+static uint8_t zswap_buf[ZSWAP_MAX_LEN];
+
+static void
+zswap_init(void)
+{
+        uint32_t i;
+
+        zswap_entry_allocator = slab_allocator_create("zswap_entry",
+                                                      sizeof(zswap_entry_t));
+        KASSERT(NULL != zswap_entry_allocator);
+
+        for (i = 0; i < ZSWAP_NCLASSES; ++i) {
+                zswap_class_allocator[i] = slab_allocator_create(zswap_class_name[i],
+                                                                 zswap_class_size[i]);
+                KASSERT(NULL != zswap_class_allocator[i]);
+        }
+
+        for (i = 0; i < ZSWAP_HASH_SIZE; ++i) {
+                list_init(&zswap_hash[i]);
+                list_init(&zswap_obj_hash[i]);
+        }
+
+        zswap_pool_max = (page_free_count() >> 3) * PAGE_SIZE;
+}
+init_func(zswap_init);
+
+static inline uint64_t
+zswap_rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return (((uint64_t) hi) << 32) | lo;
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------------ CODEC ----------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The LZF format is a sequence of chunks, each starting with a control
+ * byte c:
+ *   c < 32:  a run of c + 1 literal bytes follows.
+ *   c >= 32: a back reference of length (c >> 5) + 2, where a length
+ *            field of 7 is extended by the next byte; then one more byte
+ *            which, together with the low 5 bits of c, is the distance
+ *            back to the match minus one (so at most 8192).
+ */
+#define ZSWAP_MAX_OFF   (1 << 13)
+#define ZSWAP_MAX_REF   ((1 << 8) + (1 << 3))
+#define zswap_hash3(p)  (((((uint32_t)(p)[0]) << 16 | ((uint32_t)(p)[1]) << 8 \
+                           | (p)[2]) * 2654435761U) >> (32 - ZSWAP_HLOG))
+
+/*
+ * Compress one page into out.
+ *
+ * @return the compressed length, or -1 if it would exceed outmax
+ */
+static int
+zswap_compress(const uint8_t *in, uint8_t *out, int outmax)
+{
+        const uint8_t *ip = in;
+        const uint8_t *in_end = in + PAGE_SIZE;
+        uint8_t *op = out;
+        uint8_t *out_end = out + outmax;
+        int lit = 0;
+
+        memset(zswap_htab, 0, sizeof(zswap_htab));
+
+        /* every chunk starts with a control byte, reserve one for the
+         * first literal run */
+        op++;
+        while (ip < in_end) {
+                if (ip + 2 < in_end) {
+                        uint32_t h = zswap_hash3(ip);
+                        const uint8_t *ref = in + zswap_htab[h] - 1;
+                        uint32_t off = ip - ref - 1;
+
+                        zswap_htab[h] = ip - in + 1;
+                        if ((ref >= in) && (off < ZSWAP_MAX_OFF)
+                            && (ref[0] == ip[0]) && (ref[1] == ip[1])
+                            && (ref[2] == ip[2])) {
+                                int len = 3;
+                                int maxlen = MIN(in_end - ip, ZSWAP_MAX_REF);
+
+                                while ((len < maxlen) && (ref[len] == ip[len]))
+                                        len++;
+
+                                if (op + 4 > out_end)
+                                        return -1;
+                                /* close the pending literal run */
+                                if (0 != lit)
+                                        op[-lit - 1] = lit - 1;
+                                else
+                                        op--;
+
+                                if (len - 2 < 7) {
+                                        *op++ = (off >> 8) + ((len - 2) << 5);
+                                } else {
+                                        *op++ = (off >> 8) + (7 << 5);
+                                        *op++ = len - 2 - 7;
+                                }
+                                *op++ = off;
+
+                                lit = 0;
+                                op++;
+                                ip += len;
+                                continue;
+                        }
+                }
+
+                if (op >= out_end)
+                        return -1;
+                *op++ = *ip++;
+                if (32 == ++lit) {
+                        if (op >= out_end)
+                                return -1;
+                        op[-lit - 1] = lit - 1;
+                        lit = 0;
+                        op++;
+                }
+        }
+
+        if (0 != lit)
+                op[-lit - 1] = lit - 1;
+        else
+                op--;
+
+        return op - out;
+}
+
+/*
+ * Decompress inlen bytes into one page.
+ *
+ * @return 0 on success, -1 if the input is corrupt
+ */
+static int
+zswap_decompress(const uint8_t *in, int inlen, uint8_t *out)
+{
+        const uint8_t *ip = in;
+        const uint8_t *in_end = in + inlen;
+        uint8_t *op = out;
+        uint8_t *out_end = out + PAGE_SIZE;
+
+        while (ip < in_end) {
+                uint32_t ctrl = *ip++;
+
+                if (ctrl < 32) {
+                        ctrl++;
+                        if ((op + ctrl > out_end) || (ip + ctrl > in_end))
+                                return -1;
+                        memcpy(op, ip, ctrl);
+                        op += ctrl;
+                        ip += ctrl;
+                } else {
+                        uint32_t len = ctrl >> 5;
+                        const uint8_t *ref;
+
+                        if (7 == len) {
+                                if (ip >= in_end)
+                                        return -1;
+                                len += *ip++;
+                        }
+                        len += 2;
+                        if (ip >= in_end)
+                                return -1;
+                        ref = op - ((ctrl & 0x1f) << 8) - *ip++ - 1;
+                        if ((ref < out) || (op + len > out_end))
+                                return -1;
+                        /* the match may overlap what it produces */
+                        while (len--)
+                                *op++ = *ref++;
+                }
+        }
+
+        return (op == out_end) ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------------ CACHE ----------------------------- */
+/* ------------------------------------------------------------------ */
+
+static zswap_entry_t *
+zswap_lookup(mmobj_t *o, uint32_t pagenum)
+{
+        zswap_entry_t *ze;
+
+        list_iterate_begin(&zswap_hash[hash_zswap(o, pagenum)], ze,
+                           zswap_entry_t, ze_hlink) {
+                if ((o == ze->ze_obj) && (pagenum == ze->ze_pagenum))
+                        return ze;
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static void
+zswap_entry_free(zswap_entry_t *ze)
+{
+        zswap_stored_pages--;
+        zswap_stored_bytes -= ze->ze_len;
+        zswap_pool_bytes -= zswap_class_size[ze->ze_class];
+
+        list_remove(&ze->ze_hlink);
+        list_remove(&ze->ze_olink);
+        slab_obj_free(zswap_class_allocator[ze->ze_class], ze->ze_data);
+        slab_obj_free(zswap_entry_allocator, ze);
+}
+
+/*
+ * Compress a page and keep it. The caller must already have dropped any
+ * older copy of the page.
+ *
+ * @param o the object the page belongs to
+ * @param pagenum the page number of the page in o
+ * @param page the page contents
+ * @return 0 if the page was stored, -ENOSPC if it does not compress well
+ * enough or the pool is full, -ENOMEM if we are out of kernel memory
+ */
+int
+zswap_store(mmobj_t *o, uint32_t pagenum, const void *page)
+{
+        zswap_entry_t *ze;
+        uint32_t class;
+        int len;
+
+        KASSERT(NULL == zswap_lookup(o, pagenum));
+
+        if (0 > (len = zswap_compress(page, zswap_buf, ZSWAP_MAX_LEN))) {
+                zswap_rejects++;
+                return -ENOSPC;
+        }
+
+        for (class = 0; zswap_class_size[class] < (uint32_t) len; ++class)
+                ;
+        if (zswap_pool_bytes + zswap_class_size[class] > zswap_pool_max) {
+                zswap_rejects++;
+                return -ENOSPC;
+        }
+
+        if (NULL == (ze = slab_obj_alloc(zswap_entry_allocator)))
+                return -ENOMEM;
+        if (NULL == (ze->ze_data = slab_obj_alloc(zswap_class_allocator[class]))) {
+                slab_obj_free(zswap_entry_allocator, ze);
+                return -ENOMEM;
+        }
+
+        memcpy(ze->ze_data, zswap_buf, len);
+        ze->ze_obj = o;
+        ze->ze_pagenum = pagenum;
+        ze->ze_len = len;
+        ze->ze_class = class;
+        list_insert_head(&zswap_hash[hash_zswap(o, pagenum)], &ze->ze_hlink);
+        list_insert_head(&zswap_obj_hash[hash_zswap_obj(o)], &ze->ze_olink);
+
+        zswap_stored_pages++;
+        zswap_stored_bytes += len;
+        zswap_pool_bytes += zswap_class_size[class];
+
+        dbg(DBG_PFRAME, "compressed page %d of obj %p to %d bytes\n",
+            pagenum, o, len);
+        return 0;
+}
+
+/*
+ * Decompress a page into pf if we have it, and forget the compressed copy.
+ *
+ * @param o the object the page belongs to
+ * @param pf the (busy) page to fill
+ * @return 1 if the page was filled, 0 if we don't have it, -errno on
+ * failure
+ */
+int
+zswap_load(mmobj_t *o, pframe_t *pf)
+{
+        zswap_entry_t *ze;
+        uint64_t start;
+        uint32_t cycles;
+
+        if (NULL == (ze = zswap_lookup(o, pf->pf_pagenum)))
+                return 0;
+
+        start = zswap_rdtsc();
+        if (0 > zswap_decompress(ze->ze_data, ze->ze_len, pf->pf_addr)) {
+                panic("zswap: compressed copy of page %d of obj %p is corrupt\n",
+                      pf->pf_pagenum, o);
+        }
+        cycles = (uint32_t) (zswap_rdtsc() - start);
+
+        zswap_loads++;
+        zswap_load_cycles_avg += ((int32_t) (cycles - zswap_load_cycles_avg)) >> 3;
+        if (cycles > zswap_load_cycles_max)
+                zswap_load_cycles_max = cycles;
+
+        zswap_entry_free(ze);
+        return 1;
+}
+
+/*
+ * Returns true if the given page of the object is held compressed.
+ */
+int
+zswap_has(mmobj_t *o, uint32_t pagenum)
+{
+        return NULL != zswap_lookup(o, pagenum);
+}
+
+/*
+ * Drop the compressed copy of the given page, if there is one.
+ */
+void
+zswap_forget(mmobj_t *o, uint32_t pagenum)
+{
+        zswap_entry_t *ze;
+
+        if (NULL != (ze = zswap_lookup(o, pagenum)))
+                zswap_entry_free(ze);
+}
+
+/*
+ * Find some page of the object which is held compressed.
+ *
+ * @return 1 and the page number in *pagenum if there is one, 0 otherwise
+ */
+int
+zswap_first(mmobj_t *o, uint32_t *pagenum)
+{
+        zswap_entry_t *ze;
+
+        list_iterate_begin(&zswap_obj_hash[hash_zswap_obj(o)], ze,
+                           zswap_entry_t, ze_olink) {
+                if (o == ze->ze_obj) {
+                        *pagenum = ze->ze_pagenum;
+                        return 1;
+                }
+        } list_iterate_end();
+        return 0;
+}
+
+/*
+ * Drop all compressed pages of an object which is being destroyed.
+ */
+void
+zswap_release(mmobj_t *o)
+{
+        zswap_entry_t *ze;
+
+        list_iterate_begin(&zswap_obj_hash[hash_zswap_obj(o)], ze,
+                           zswap_entry_t, ze_olink) {
+                if (o == ze->ze_obj)
+                        zswap_entry_free(ze);
+        } list_iterate_end();
+}